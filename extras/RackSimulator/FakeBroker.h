@@ -0,0 +1,362 @@
+/*
+ * FakeBroker.h
+ */
+
+#ifndef FAKE_BROKER_H
+#define FAKE_BROKER_H
+
+#include <OXRS_Room8266.h>
+
+// Just enough of an MQTT 3.1.1 broker (QoS 0, no retained/will messages)
+// to talk to PubSubClient over loopback pipes, counting everything it sees
+#define       BROKER_MAX_CONNECTIONS    128
+#define       BROKER_MAX_SUBSCRIPTIONS  8
+#define       BROKER_TOPIC_SIZE         64
+#define       BROKER_CLIENT_ID_SIZE     32
+#define       BROKER_PACKET_SIZE        8192
+
+// Called for every PUBLISH a device sends
+typedef void (*brokerPublishCallback)(const char * clientId, const char * topic, const uint8_t * payload, uint32_t length);
+
+class FakeBroker
+{
+  public:
+    struct Stats
+    {
+      uint32_t connects;
+      uint32_t disconnects;
+      uint32_t messagesIn;
+      uint32_t messagesOut;
+      uint32_t bytesIn;
+      uint32_t bytesOut;
+      uint32_t oversized;
+      uint32_t dropped;
+    };
+
+    void onPublish(brokerPublishCallback callback) { _onPublish = callback; }
+
+    // Hand out a free pipe to a connecting device
+    LoopbackPipe * accept(void)
+    {
+      for (uint16_t i = 0; i < BROKER_MAX_CONNECTIONS; i++)
+      {
+        Connection * conn = &_connections[i];
+        if (conn->pipe.held) { continue; }
+
+        conn->active = true;
+        conn->connected = false;
+        conn->clientId[0] = 0;
+        conn->subscriptionCount = 0;
+        conn->rxLength = 0;
+        conn->skip = 0;
+        return &conn->pipe;
+      }
+      return NULL;
+    }
+
+    // Process whatever the devices have sent
+    void loop(void)
+    {
+      for (uint16_t i = 0; i < BROKER_MAX_CONNECTIONS; i++)
+      {
+        Connection * conn = &_connections[i];
+        if (!conn->active) { continue; }
+
+        _receive(conn);
+
+        if (!conn->pipe.open)
+        {
+          if (conn->connected) { _stats.disconnects++; }
+          conn->active = false;
+          conn->connected = false;
+        }
+      }
+    }
+
+    // Publish to every subscription matching the topic, returns the number of deliveries
+    uint16_t publish(const char * topic, const uint8_t * payload, uint32_t length)
+    {
+      uint16_t deliveries = 0;
+      for (uint16_t i = 0; i < BROKER_MAX_CONNECTIONS; i++)
+      {
+        Connection * conn = &_connections[i];
+        if (!conn->connected) { continue; }
+
+        for (uint8_t j = 0; j < conn->subscriptionCount; j++)
+        {
+          if (_matches(conn->subscriptions[j], topic))
+          {
+            _sendPublish(conn, topic, payload, length);
+            deliveries++;
+            break;
+          }
+        }
+      }
+      return deliveries;
+    }
+
+    // Drop every connection at once (e.g. a broker restart)
+    void dropAll(void)
+    {
+      for (uint16_t i = 0; i < BROKER_MAX_CONNECTIONS; i++)
+      {
+        if (_connections[i].active) { _connections[i].pipe.open = false; }
+      }
+    }
+
+    uint16_t getConnectedCount(void)
+    {
+      uint16_t count = 0;
+      for (uint16_t i = 0; i < BROKER_MAX_CONNECTIONS; i++)
+      {
+        if (_connections[i].connected) { count++; }
+      }
+      return count;
+    }
+
+    Stats * getStats(void) { return &_stats; }
+
+  private:
+    struct Connection
+    {
+      LoopbackPipe pipe;
+      bool active;
+      bool connected;
+      char clientId[BROKER_CLIENT_ID_SIZE];
+      char subscriptions[BROKER_MAX_SUBSCRIPTIONS][BROKER_TOPIC_SIZE];
+      uint8_t subscriptionCount;
+
+      // Partial packet, or bytes left to skip of one too big to buffer
+      uint8_t rx[BROKER_PACKET_SIZE];
+      uint32_t rxLength;
+      uint32_t skip;
+    };
+
+    Connection _connections[BROKER_MAX_CONNECTIONS];
+    Stats _stats = { 0 };
+    brokerPublishCallback _onPublish = NULL;
+
+    void _receive(Connection * conn)
+    {
+      LoopbackRing * ring = &conn->pipe.fromDevice;
+
+      while (ring->available())
+      {
+        if (conn->skip)
+        {
+          ring->read();
+          conn->skip--;
+          continue;
+        }
+
+        if (conn->rxLength < BROKER_PACKET_SIZE)
+        {
+          conn->rx[conn->rxLength++] = ring->read();
+          _stats.bytesIn++;
+        }
+
+        // Fixed header, then a variable length (up to 4 bytes) remaining length
+        uint32_t remaining = 0;
+        uint8_t headerLength = 0;
+        if (!_decodeLength(conn->rx, conn->rxLength, &remaining, &headerLength)) { continue; }
+
+        if (headerLength + remaining > BROKER_PACKET_SIZE)
+        {
+          _stats.oversized++;
+          conn->skip = headerLength + remaining - conn->rxLength;
+          conn->rxLength = 0;
+          continue;
+        }
+
+        if (conn->rxLength < headerLength + remaining) { continue; }
+
+        _handle(conn, conn->rx[0], &conn->rx[headerLength], remaining);
+        conn->rxLength = 0;
+      }
+    }
+
+    bool _decodeLength(const uint8_t * buffer, uint32_t length, uint32_t * remaining, uint8_t * headerLength)
+    {
+      uint32_t multiplier = 1;
+      *remaining = 0;
+
+      for (uint8_t i = 1; i < 5; i++)
+      {
+        if (i >= length) { return false; }
+
+        *remaining += (buffer[i] & 0x7F) * multiplier;
+        multiplier *= 128;
+
+        if (!(buffer[i] & 0x80))
+        {
+          *headerLength = i + 1;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    uint16_t _readString(const uint8_t * buffer, uint32_t length, uint32_t * position, char * string, uint16_t size)
+    {
+      if (*position + 2 > length) { return 0; }
+
+      uint16_t stringLength = (buffer[*position] << 8) | buffer[*position + 1];
+      *position += 2;
+
+      if (*position + stringLength > length) { stringLength = length - *position; }
+
+      uint16_t copy = stringLength < size - 1 ? stringLength : size - 1;
+      memcpy(string, &buffer[*position], copy);
+      string[copy] = 0;
+
+      *position += stringLength;
+      return stringLength;
+    }
+
+    void _handle(Connection * conn, uint8_t header, const uint8_t * body, uint32_t length)
+    {
+      uint32_t position = 0;
+
+      switch (header >> 4)
+      {
+        case 1:
+        {
+          // CONNECT - skip protocol name, level, flags and keep alive
+          char protocol[8];
+          _readString(body, length, &position, protocol, sizeof(protocol));
+          position += 4;
+          _readString(body, length, &position, conn->clientId, sizeof(conn->clientId));
+
+          conn->connected = true;
+          _stats.connects++;
+
+          const uint8_t connack[] = { 0x20, 0x02, 0x00, 0x00 };
+          _send(conn, connack, sizeof(connack));
+          break;
+        }
+
+        case 3:
+        {
+          // PUBLISH (QoS 0 only, anything else just skips the packet id)
+          char topic[BROKER_TOPIC_SIZE];
+          _readString(body, length, &position, topic, sizeof(topic));
+          if (header & 0x06) { position += 2; }
+
+          _stats.messagesIn++;
+          if (_onPublish) { _onPublish(conn->clientId, topic, &body[position], length - position); }
+
+          publish(topic, &body[position], length - position);
+          break;
+        }
+
+        case 8:
+        {
+          // SUBSCRIBE
+          uint8_t suback[4 + BROKER_MAX_SUBSCRIPTIONS] = { 0x90, 0x02, body[0], body[1] };
+          uint8_t count = 0;
+          position = 2;
+
+          while (position < length && count < BROKER_MAX_SUBSCRIPTIONS)
+          {
+            char filter[BROKER_TOPIC_SIZE];
+            _readString(body, length, &position, filter, sizeof(filter));
+            position++;
+
+            // Granted QoS 0, or failure if we have no room left for it
+            if (conn->subscriptionCount < BROKER_MAX_SUBSCRIPTIONS)
+            {
+              strcpy(conn->subscriptions[conn->subscriptionCount++], filter);
+              suback[4 + count++] = 0x00;
+            }
+            else
+            {
+              suback[4 + count++] = 0x80;
+            }
+          }
+
+          suback[1] = 2 + count;
+          _send(conn, suback, 4 + count);
+          break;
+        }
+
+        case 10:
+        {
+          // UNSUBSCRIBE (just acknowledged)
+          const uint8_t unsuback[] = { 0xB0, 0x02, body[0], body[1] };
+          _send(conn, unsuback, sizeof(unsuback));
+          break;
+        }
+
+        case 12:
+        {
+          // PINGREQ
+          const uint8_t pingresp[] = { 0xD0, 0x00 };
+          _send(conn, pingresp, sizeof(pingresp));
+          break;
+        }
+
+        case 14:
+          // DISCONNECT
+          conn->pipe.open = false;
+          break;
+      }
+    }
+
+    void _sendPublish(Connection * conn, const char * topic, const uint8_t * payload, uint32_t length)
+    {
+      uint16_t topicLength = strlen(topic);
+      uint32_t remaining = 2 + topicLength + length;
+
+      uint8_t header[5] = { 0x30 };
+      uint8_t headerLength = 1;
+      do
+      {
+        header[headerLength] = remaining % 128;
+        remaining /= 128;
+        if (remaining) { header[headerLength] |= 0x80; }
+        headerLength++;
+      } while (remaining);
+
+      // Drop the whole message if the device can't take it
+      if (conn->pipe.toDevice.availableForWrite() < (int)(headerLength + 2 + topicLength + length))
+      {
+        _stats.dropped++;
+        return;
+      }
+
+      const uint8_t topicHeader[] = { (uint8_t)(topicLength >> 8), (uint8_t)topicLength };
+      _send(conn, header, headerLength);
+      _send(conn, topicHeader, sizeof(topicHeader));
+      _send(conn, (const uint8_t *)topic, topicLength);
+      _send(conn, payload, length);
+
+      _stats.messagesOut++;
+    }
+
+    void _send(Connection * conn, const uint8_t * buffer, uint32_t length)
+    {
+      _stats.bytesOut += conn->pipe.toDevice.write(buffer, length);
+    }
+
+    bool _matches(const char * filter, const char * topic)
+    {
+      while (*filter)
+      {
+        if (*filter == '#') { return true; }
+
+        if (*filter == '+')
+        {
+          while (*topic && *topic != '/') { topic++; }
+          filter++;
+          continue;
+        }
+
+        if (*filter != *topic) { return false; }
+        filter++;
+        topic++;
+      }
+      return *topic == 0;
+    }
+};
+
+#endif
@@ -0,0 +1,304 @@
+/*
+ * RackSimulator.ino
+ *
+ * Runs a rack of virtual Room8266 devices against an in-process broker to
+ * test broker-side scaling (adoption bursts, command fan-out and reconnect
+ * storms) before deploying firmware.
+ *
+ * Host only - build with LOOPBACK_MODE defined (for the library as well as
+ * this sketch) against a host Arduino core which provides Serial, millis(),
+ * micros(), LittleFS and ESP stubs, along with the usual FW_* build flags.
+ * It lives in extras/ rather than examples/ as it can't build for the
+ * library's (ESP8266) architecture.
+ *
+ * The rack runs on a virtual clock, every device's timers (backoff, Home
+ * Assistant pacing, LED) and delays go through setClock(). Each round of
+ * the rack advances it by SIM_TICK_MS, so scenario timings are in rack
+ * time and independent of how fast the host is. Loop latency is still
+ * measured in real micros(), it is the host CPU cost of a device loop().
+ *
+ * NOTE: every device shares the host file system, adoption schema hashes
+ *       are saved per device (LOOPBACK_MODE only) but any MQTT config saved
+ *       via the REST API is shared
+ *
+ * NOTE: the MQTT libraries (OXRS_MQTT, PubSubClient) keep the host's real
+ *       millis() for their own keep-alive and timeouts
+ */
+
+#include <OXRS_Room8266.h>
+#include "FakeBroker.h"
+
+#if !defined(LOOPBACK_MODE)
+#error "The rack simulator needs the loopback transport, build with LOOPBACK_MODE"
+#endif
+
+// Simulation
+#define       SIM_DEVICES               32
+#define       SIM_BROKER_HOST           "broker"
+#define       SIM_BROKER_PORT           1883
+#define       SIM_FANOUT_AT_MS          10000
+#define       SIM_STORM_AT_MS           20000
+#define       SIM_REPORT_MS             5000
+#define       SIM_TICK_MS               1
+
+// Every device is statically allocated, nothing is created at runtime
+OXRS_Room8266 devices[SIM_DEVICES];
+FakeBroker broker;
+
+// Per-device loop latency
+struct LoopStats
+{
+  uint32_t loops;
+  uint64_t totalMicros;
+  uint32_t maxMicros;
+};
+
+LoopStats loopStats[SIM_DEVICES];
+
+// Virtual clock, and when the scenario started on it (after every device
+// has started, the LED self test alone is 2s per device)
+uint32_t simClockMillis = 0L;
+uint32_t simStartMillis = 0L;
+
+char adoptTopics[SIM_DEVICES][64];
+bool adoptedDevices[SIM_DEVICES];
+uint16_t adopted = 0;
+uint32_t adoptedMillis = 0L;
+
+bool fanoutSent = false;
+uint16_t fanoutReceived = 0;
+uint32_t fanoutSentMillis = 0L;
+uint32_t fanoutMillis = 0L;
+
+bool stormSent = false;
+uint32_t stormConnects = 0L;
+uint32_t stormSentMillis = 0L;
+uint32_t stormMillis = 0L;
+
+uint32_t lastReportMillis = 0L;
+
+/* Virtual clock */
+uint32_t clockMillis(void)
+{
+  return simClockMillis;
+}
+
+void clockDelay(uint32_t ms)
+{
+  // Nothing else runs while a device delays, so just move time on
+  simClockMillis += ms;
+}
+
+uint32_t simMillis(void)
+{
+  // Scenario time, every timer here goes through this
+  return simClockMillis - simStartMillis;
+}
+
+/* Broker callbacks */
+LoopbackPipe * brokerConnect(const char * host, uint16_t port)
+{
+  return broker.accept();
+}
+
+void brokerPublish(const char * clientId, const char * topic, const uint8_t * payload, uint32_t length)
+{
+  // Each device publishes adoption info to its adopt topic once it connects
+  // (and again after every reconnect, only the first counts)
+  for (uint16_t i = 0; i < SIM_DEVICES; i++)
+  {
+    if (adoptedDevices[i] || strcmp(topic, adoptTopics[i]) != 0) { continue; }
+
+    adoptedDevices[i] = true;
+    if (++adopted == SIM_DEVICES) { adoptedMillis = simMillis(); }
+    break;
+  }
+}
+
+/* Firmware callbacks (shared by every device) */
+void jsonConfig(JsonVariant json)
+{
+}
+
+void jsonCommand(JsonVariant json)
+{
+  if (json["simFanout"].is<bool>() && ++fanoutReceived == SIM_DEVICES)
+  {
+    fanoutMillis = simMillis() - fanoutSentMillis;
+  }
+}
+
+/* Scenario */
+void sendFanout(void)
+{
+  // Publish a command to every device via the broker
+  const char * payload = "{\"simFanout\":true}";
+
+  for (uint16_t i = 0; i < SIM_DEVICES; i++)
+  {
+    char topic[64];
+    devices[i].getMQTT()->getCommandTopic(topic);
+    broker.publish(topic, (const uint8_t *)payload, strlen(payload));
+  }
+
+  fanoutSent = true;
+  fanoutSentMillis = simMillis();
+}
+
+void sendStorm(void)
+{
+  // Drop every device at once, they all reconnect (with backoff/jitter)
+  broker.dropAll();
+
+  stormSent = true;
+  stormConnects = broker.getStats()->connects;
+  stormSentMillis = simMillis();
+}
+
+void report(void)
+{
+  FakeBroker::Stats * stats = broker.getStats();
+  float seconds = simMillis() / 1000.0;
+
+  Serial.print(F("[sim] t="));
+  Serial.print(seconds);
+  Serial.print(F("s connected="));
+  Serial.print(broker.getConnectedCount());
+  Serial.print(F("/"));
+  Serial.println(SIM_DEVICES);
+
+  Serial.print(F("[sim] broker connects="));
+  Serial.print(stats->connects);
+  Serial.print(F(" disconnects="));
+  Serial.print(stats->disconnects);
+  Serial.print(F(" in="));
+  Serial.print(stats->messagesIn / seconds);
+  Serial.print(F("msg/s out="));
+  Serial.print(stats->messagesOut / seconds);
+  Serial.print(F("msg/s bytesIn="));
+  Serial.print(stats->bytesIn);
+  Serial.print(F(" bytesOut="));
+  Serial.print(stats->bytesOut);
+  Serial.print(F(" oversized="));
+  Serial.print(stats->oversized);
+  Serial.print(F(" dropped="));
+  Serial.println(stats->dropped);
+
+  Serial.print(F("[sim] adoption "));
+  Serial.print(adopted);
+  Serial.print(F("/"));
+  Serial.print(SIM_DEVICES);
+  if (adoptedMillis)
+  {
+    Serial.print(F(" complete after "));
+    Serial.print(adoptedMillis);
+    Serial.print(F("ms"));
+  }
+  Serial.println();
+
+  if (fanoutSent)
+  {
+    Serial.print(F("[sim] command fan-out "));
+    Serial.print(fanoutReceived);
+    Serial.print(F("/"));
+    Serial.print(SIM_DEVICES);
+    if (fanoutMillis)
+    {
+      Serial.print(F(" complete after "));
+      Serial.print(fanoutMillis);
+      Serial.print(F("ms"));
+    }
+    Serial.println();
+  }
+
+  if (stormSent)
+  {
+    Serial.print(F("[sim] reconnect storm "));
+    Serial.print(broker.getStats()->connects - stormConnects);
+    Serial.print(F("/"));
+    Serial.print(SIM_DEVICES);
+    if (stormMillis)
+    {
+      Serial.print(F(" reconnected after "));
+      Serial.print(stormMillis);
+      Serial.print(F("ms"));
+    }
+    Serial.println();
+  }
+
+  // Loop latency across the rack (average of averages, worst case overall)
+  uint64_t averageMicros = 0;
+  uint32_t maxMicros = 0;
+  for (uint16_t i = 0; i < SIM_DEVICES; i++)
+  {
+    if (loopStats[i].loops) { averageMicros += loopStats[i].totalMicros / loopStats[i].loops; }
+    if (loopStats[i].maxMicros > maxMicros) { maxMicros = loopStats[i].maxMicros; }
+  }
+
+  Serial.print(F("[sim] device loop avg="));
+  Serial.print((uint32_t)(averageMicros / SIM_DEVICES));
+  Serial.print(F("us max="));
+  Serial.print(maxMicros);
+  Serial.println(F("us"));
+}
+
+/* Main program */
+void setup()
+{
+  Serial.begin(115200);
+
+  // Devices connect out to our broker
+  LoopbackClient::onConnect() = brokerConnect;
+  broker.onPublish(brokerPublish);
+
+  for (uint16_t i = 0; i < SIM_DEVICES; i++)
+  {
+    // Unique MAC (and so client id) for each device
+    byte mac[6] = { 0x02, 0x00, 0x00, 0x00, (byte)(i >> 8), (byte)i };
+    devices[i].getTransport()->setMac(mac);
+    devices[i].getTransport()->setIP(IPAddress(10, 0, i >> 8, i));
+
+    devices[i].setClock(clockMillis, clockDelay);
+    devices[i].begin(jsonConfig, jsonCommand);
+    devices[i].getMQTT()->setBroker(SIM_BROKER_HOST, SIM_BROKER_PORT);
+
+    // Known once begin() has set the client id
+    devices[i].getMQTT()->getAdoptTopic(adoptTopics[i]);
+  }
+
+  simStartMillis = simClockMillis;
+}
+
+void loop()
+{
+  // Round robin every device, then let the broker deliver
+  for (uint16_t i = 0; i < SIM_DEVICES; i++)
+  {
+    uint32_t start = micros();
+    devices[i].loop();
+    uint32_t elapsed = micros() - start;
+
+    loopStats[i].loops++;
+    loopStats[i].totalMicros += elapsed;
+    if (elapsed > loopStats[i].maxMicros) { loopStats[i].maxMicros = elapsed; }
+  }
+
+  broker.loop();
+
+  // One round of the rack is one tick of the clock
+  simClockMillis += SIM_TICK_MS;
+
+  if (!fanoutSent && simMillis() >= SIM_FANOUT_AT_MS) { sendFanout(); }
+  if (!stormSent && simMillis() >= SIM_STORM_AT_MS) { sendStorm(); }
+
+  if (stormSent && !stormMillis && (broker.getStats()->connects - stormConnects) >= SIM_DEVICES)
+  {
+    stormMillis = simMillis() - stormSentMillis;
+  }
+
+  if ((simMillis() - lastReportMillis) >= SIM_REPORT_MS)
+  {
+    lastReportMillis = simMillis();
+    report();
+  }
+}
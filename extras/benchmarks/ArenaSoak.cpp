@@ -0,0 +1,287 @@
+/*
+ * ArenaSoak.cpp
+ *
+ * Host soak benchmark for the JSON arena (src/JsonArena.h). Runs the same
+ * mix of transient documents - inbound config/commands, Home Assistant
+ * discovery payloads and the occasional large adopt schema - against a
+ * model of the ESP8266 heap, once with every document on the heap (as
+ * before the arena) and once through the arena, and reports heap
+ * fragmentation at the start and end of each soak.
+ *
+ * The heap model is a 40KB first-fit allocator with coalescing, close
+ * enough to umm_malloc for comparing fragmentation. Long-lived background
+ * allocations (other libraries, Strings etc) come and go throughout. The
+ * arena itself is taken from the same heap (on a device it is part of the
+ * OXRS_Room8266 instance), so both runs start from the same memory.
+ *
+ * Build (ArduinoJson 7 is header only):
+ *   g++ -std=c++17 -O2 -I../../src -I<path to ArduinoJson>/src ArenaSoak.cpp -o ArenaSoak
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <new>
+#include <ArduinoJson.h>
+
+typedef uint8_t byte;
+#include "JsonArena.h"
+
+#define       SOAK_HEAP_SIZE            40960
+#define       SOAK_ARENA_SIZE           2048
+#define       SOAK_ITERATIONS           20000
+#define       SOAK_BACKGROUND_SLOTS     32
+#define       SOAK_DISCOVERY_EVERY      10
+#define       SOAK_BACKGROUND_EVERY     20
+#define       SOAK_ADOPT_EVERY          250
+
+// First-fit heap with an implicit block list, blocks are prefixed by their
+// size (including the header) and whether they are in use
+class SimHeap : public ArduinoJson::Allocator
+{
+  public:
+    SimHeap(void) { _setBlock(0, SOAK_HEAP_SIZE, false); }
+
+    void * allocate(size_t size) override
+    {
+      uint32_t need = HEADER_SIZE + _align(size);
+      for (uint32_t offset = 0; offset < SOAK_HEAP_SIZE; offset += _size(offset))
+      {
+        if (_used(offset) || _size(offset) < need) { continue; }
+
+        // Split if what is left over is worth keeping
+        uint32_t remaining = _size(offset) - need;
+        if (remaining >= HEADER_SIZE + ALIGNMENT)
+        {
+          _setBlock(offset + need, remaining, false);
+          _setBlock(offset, need, true);
+        }
+        else
+        {
+          _setBlock(offset, _size(offset), true);
+        }
+        return &_heap[offset + HEADER_SIZE];
+      }
+
+      _failures++;
+      return NULL;
+    }
+
+    void deallocate(void * pointer) override
+    {
+      if (!pointer) { return; }
+
+      uint32_t offset = (byte *)pointer - _heap - HEADER_SIZE;
+      _setBlock(offset, _size(offset), false);
+      _coalesce();
+    }
+
+    void * reallocate(void * pointer, size_t size) override
+    {
+      if (!pointer) { return allocate(size); }
+
+      uint32_t offset = (byte *)pointer - _heap - HEADER_SIZE;
+      uint32_t oldSize = _size(offset) - HEADER_SIZE;
+      if (_align(size) <= oldSize) { return pointer; }
+
+      void * moved = allocate(size);
+      if (!moved) { return NULL; }
+
+      memcpy(moved, pointer, oldSize);
+      deallocate(pointer);
+      return moved;
+    }
+
+    // Same measure as ESP.getHeapFragmentation()
+    void getStats(uint32_t * freeBytes, uint32_t * largestFree, uint8_t * fragmentation)
+    {
+      double squares = 0;
+      *freeBytes = *largestFree = 0;
+      for (uint32_t offset = 0; offset < SOAK_HEAP_SIZE; offset += _size(offset))
+      {
+        if (_used(offset)) { continue; }
+
+        uint32_t size = _size(offset) - HEADER_SIZE;
+        *freeBytes += size;
+        squares += (double)size * size;
+        if (size > *largestFree) { *largestFree = size; }
+      }
+      *fragmentation = *freeBytes ? 100 - (uint8_t)(sqrt(squares) * 100 / *freeBytes) : 0;
+    }
+
+    uint32_t getFailures(void) { return _failures; }
+
+  private:
+    static const uint32_t ALIGNMENT = 8;
+    static const uint32_t HEADER_SIZE = 8;
+
+    alignas(ALIGNMENT) byte _heap[SOAK_HEAP_SIZE];
+    uint32_t _failures = 0;
+
+    static uint32_t _align(size_t size) { return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1); }
+
+    uint32_t _size(uint32_t offset) { uint32_t size; memcpy(&size, &_heap[offset], 4); return size; }
+    bool _used(uint32_t offset) { return _heap[offset + 4]; }
+
+    void _setBlock(uint32_t offset, uint32_t size, bool used)
+    {
+      memcpy(&_heap[offset], &size, 4);
+      _heap[offset + 4] = used;
+    }
+
+    void _coalesce(void)
+    {
+      uint32_t offset = 0;
+      while (offset < SOAK_HEAP_SIZE)
+      {
+        uint32_t next = offset + _size(offset);
+        if (!_used(offset) && next < SOAK_HEAP_SIZE && !_used(next))
+        {
+          _setBlock(offset, _size(offset) + _size(next), false);
+          continue;
+        }
+        offset = next;
+      }
+    }
+};
+
+/* Workload */
+uint32_t randomState = 1;
+
+uint32_t nextRandom(uint32_t range)
+{
+  // xorshift32, deterministic so both runs see the same workload
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState % range;
+}
+
+void inboundMessage(ArduinoJson::Allocator * allocator)
+{
+  char payload[1024];
+  int length = snprintf(payload, sizeof(payload), "{");
+
+  uint8_t keys = 1 + nextRandom(30);
+  for (uint8_t i = 0; i < keys; i++)
+  {
+    length += snprintf(&payload[length], sizeof(payload) - length, "%s\"key%u\":\"value%lu\"", i ? "," : "", i, (unsigned long)nextRandom(100000));
+  }
+  snprintf(&payload[length], sizeof(payload) - length, "}");
+
+  JsonDocument json(allocator);
+  deserializeJson(json, payload);
+}
+
+void discoveryPayload(ArduinoJson::Allocator * allocator)
+{
+  JsonDocument json(allocator);
+  json["name"] = "Sensor";
+  json["unique_id"] = "room8266_abcdef_sensor";
+  json["state_topic"] = "stat/abcdef";
+  json["value_template"] = "{{ value_json.temperature }}";
+  JsonObject device = json["device"].to<JsonObject>();
+  device["name"] = "Room8266";
+  device["manufacturer"] = "SuperHouse Automation";
+  device["identifiers"].add("abcdef");
+}
+
+void adoptSchema(ArduinoJson::Allocator * allocator)
+{
+  // Roughly the size of a real firmware's config schema
+  JsonDocument json(allocator);
+  JsonObject properties = json["configSchema"]["properties"].to<JsonObject>();
+  for (uint8_t i = 0; i < 60; i++)
+  {
+    char key[16];
+    snprintf(key, sizeof(key), "property%u", i);
+
+    JsonObject property = properties[key].to<JsonObject>();
+    property["title"] = "A configurable property";
+    property["description"] = "Something firmware lets the user configure, with a longer description.";
+    property["type"] = "integer";
+    property["minimum"] = 0;
+    property["maximum"] = 255;
+  }
+}
+
+/* Soak */
+struct Background
+{
+  void * pointer;
+  uint32_t expires;
+};
+
+void report(const char * label, SimHeap * heap)
+{
+  uint32_t freeBytes, largestFree;
+  uint8_t fragmentation;
+  heap->getStats(&freeBytes, &largestFree, &fragmentation);
+
+  printf("  %-6s free=%u largestFree=%u fragmentation=%u%% failedAllocations=%u\n",
+    label, freeBytes, largestFree, fragmentation, heap->getFailures());
+}
+
+void soak(const char * name, bool useArena)
+{
+  SimHeap * heap = new SimHeap();
+  randomState = 1;
+
+  // Only the arena run pays for the arena, out of the simulated heap
+  JsonArena<SOAK_ARENA_SIZE> * arena = NULL;
+  if (useArena)
+  {
+    void * memory = heap->allocate(sizeof(JsonArena<SOAK_ARENA_SIZE>));
+    arena = new (memory) JsonArena<SOAK_ARENA_SIZE>(heap);
+  }
+
+  ArduinoJson::Allocator * allocator = useArena ? (ArduinoJson::Allocator *)arena : (ArduinoJson::Allocator *)heap;
+  Background background[SOAK_BACKGROUND_SLOTS] = { { NULL, 0 } };
+
+  printf("%s\n", name);
+  report("start", heap);
+
+  for (uint32_t i = 0; i < SOAK_ITERATIONS; i++)
+  {
+    // Long-lived allocations from everything else on the device
+    if (i % SOAK_BACKGROUND_EVERY == 0)
+    {
+      Background * slot = &background[nextRandom(SOAK_BACKGROUND_SLOTS)];
+      if (slot->pointer && slot->expires <= i)
+      {
+        heap->deallocate(slot->pointer);
+        slot->pointer = NULL;
+      }
+      if (!slot->pointer)
+      {
+        slot->pointer = heap->allocate(16 + nextRandom(240));
+        slot->expires = i + nextRandom(SOAK_ITERATIONS / 10);
+      }
+    }
+
+    inboundMessage(allocator);
+    if (i % SOAK_DISCOVERY_EVERY == 0) { discoveryPayload(allocator); }
+    if (i % SOAK_ADOPT_EVERY == 0) { adoptSchema(allocator); }
+  }
+
+  report("end", heap);
+  if (useArena)
+  {
+    printf("  arena  highWater=%zu overflows=%u\n", arena->getHighWater(), arena->getOverflows());
+  }
+
+  if (arena)
+  {
+    arena->~JsonArena<SOAK_ARENA_SIZE>();
+    heap->deallocate(arena);
+  }
+  delete heap;
+}
+
+int main(void)
+{
+  soak("heap (every document allocated on the heap)", false);
+  soak("arena (JSON_ARENA_SIZE 2048, overflow to the heap)", true);
+  return 0;
+}
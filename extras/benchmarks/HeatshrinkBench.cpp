@@ -0,0 +1,196 @@
+/*
+ * HeatshrinkBench.cpp
+ *
+ * Host benchmark for the heatshrink adoption payload compression
+ * (src/HeatshrinkPrint.h), reporting the compression ratio and encode time
+ * for adopt payloads of a few sizes - the library's own schema, a typical
+ * firmware and a large one. Every compressed payload is also decoded and
+ * compared with the original.
+ *
+ * Host times only compare payloads with each other, the ESP8266 is a lot
+ * slower (the encoder searches the whole 256 byte window for each token).
+ *
+ * Build (Print.h here stands in for the Arduino core):
+ *   g++ -std=c++17 -O2 -I. -I../../src HeatshrinkBench.cpp ../../src/HeatshrinkPrint.cpp -o HeatshrinkBench
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <chrono>
+#include <string>
+
+#include "HeatshrinkPrint.h"
+
+#define       BENCH_ITERATIONS          200
+
+// Collects compressed output
+class StringPrint : public Print
+{
+  public:
+    std::string data;
+
+    virtual size_t write(uint8_t character) { data += (char)character; return 1; }
+    using Print::write;
+};
+
+/* Payload */
+void appendf(std::string & out, const char * format, ...)
+{
+  char buffer[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  out += buffer;
+}
+
+// Roughly what GET /adopt returns, firmware/system/network details followed
+// by config and command schemas with the given number of firmware properties
+std::string buildAdoptPayload(uint8_t properties)
+{
+  std::string json;
+  json += "{\"firmware\":{\"name\":\"OXRS-SHA-Room8266-ESP8266-FW\",\"shortName\":\"OXRS Room8266\","
+          "\"maker\":\"SuperHouse Automation\",\"version\":\"1.4.2\","
+          "\"githubUrl\":\"https://github.com/SuperHouse/OXRS-SHA-Room8266-ESP8266-FW\"},";
+  json += "\"system\":{\"heapUsedBytes\":3184,\"heapFreeBytes\":21240,\"flashChipSizeBytes\":4194304,"
+          "\"sketchSpaceUsedBytes\":471632,\"sketchSpaceTotalBytes\":1572864,"
+          "\"fileSystemUsedBytes\":16384,\"fileSystemTotalBytes\":1048576},";
+  json += "\"network\":{\"mode\":\"ethernet\",\"ip\":\"192.168.1.107\",\"mac\":\"5C:CF:7F:A1:B2:C3\"},";
+
+  json += "\"configSchema\":{\"$schema\":\"http://json-schema.org/draft-07/schema#\",\"type\":\"object\",\"properties\":{";
+  json += "\"hassDiscoveryEnabled\":{\"title\":\"Home Assistant Discovery\",\"description\":\"Publish Home Assistant discovery config (defaults to 'false').\",\"type\":\"boolean\"},";
+  json += "\"hassDiscoveryTopicPrefix\":{\"title\":\"Home Assistant Discovery Topic Prefix\",\"description\":\"Prefix for the Home Assistant discovery topic (defaults to 'homeassistant').\",\"type\":\"string\"}";
+
+  for (uint8_t i = 0; i < properties; i++)
+  {
+    appendf(json, ",\"property%u\":{\"title\":\"Property %u\",\"description\":\"Something firmware lets the user configure, with a longer description.\"", i, i);
+
+    // A mix of simple, ranged, enum and nested (array of object) properties
+    switch (i % 4)
+    {
+      case 0:
+        json += ",\"type\":\"boolean\"}";
+        break;
+
+      case 1:
+        json += ",\"type\":\"integer\",\"minimum\":1,\"maximum\":255}";
+        break;
+
+      case 2:
+        json += ",\"enum\":[\"off\",\"on\",\"auto\"]}";
+        break;
+
+      case 3:
+        json += ",\"type\":\"array\",\"items\":{\"type\":\"object\",\"properties\":{"
+                "\"index\":{\"type\":\"integer\",\"minimum\":1},\"mode\":{\"type\":\"string\"}}}}";
+        break;
+    }
+  }
+  json += "}},";
+
+  json += "\"commandSchema\":{\"$schema\":\"http://json-schema.org/draft-07/schema#\",\"type\":\"object\",\"properties\":{"
+          "\"restart\":{\"title\":\"Restart\",\"type\":\"boolean\"}";
+  for (uint8_t i = 0; i < properties / 4; i++)
+  {
+    appendf(json, ",\"command%u\":{\"title\":\"Command %u\",\"type\":\"integer\",\"minimum\":0,\"maximum\":100}", i, i);
+  }
+  json += "}}}";
+
+  return json;
+}
+
+/* Decoder (for checking the round trip) */
+class BitReader
+{
+  public:
+    BitReader(const std::string & data) : _data(data) {}
+
+    size_t remaining(void) { return _data.size() * 8 - _position; }
+
+    uint16_t read(uint8_t bits)
+    {
+      uint16_t value = 0;
+      while (bits--)
+      {
+        uint8_t current = _data[_position / 8];
+        value = (value << 1) | ((current >> (7 - _position % 8)) & 1);
+        _position++;
+      }
+      return value;
+    }
+
+  private:
+    const std::string & _data;
+    size_t _position = 0;
+};
+
+std::string decode(const std::string & compressed)
+{
+  std::string out;
+  BitReader bits(compressed);
+
+  // The final byte is zero padded, never a whole token
+  while (bits.remaining() >= 1 + 8)
+  {
+    if (bits.read(1))
+    {
+      out += (char)bits.read(8);
+      continue;
+    }
+
+    if (bits.remaining() < HEATSHRINK_WINDOW_BITS + HEATSHRINK_LOOKAHEAD_BITS) { break; }
+    uint16_t distance = bits.read(HEATSHRINK_WINDOW_BITS) + 1;
+    uint16_t length = bits.read(HEATSHRINK_LOOKAHEAD_BITS) + 1;
+    for (uint16_t i = 0; i < length; i++)
+    {
+      out += out[out.size() - distance];
+    }
+  }
+  return out;
+}
+
+/* Benchmark */
+bool bench(const char * name, uint8_t properties)
+{
+  std::string payload = buildAdoptPayload(properties);
+
+  // Sized first, as the library does before publishing
+  CountPrint count;
+  HeatshrinkPrint sizer(count);
+  sizer.write((const uint8_t *)payload.data(), payload.size());
+  sizer.finish();
+
+  StringPrint out;
+  double totalMicros = 0;
+  for (uint16_t i = 0; i < BENCH_ITERATIONS; i++)
+  {
+    out.data.clear();
+
+    auto start = std::chrono::steady_clock::now();
+    HeatshrinkPrint compressor(out);
+    compressor.write((const uint8_t *)payload.data(), payload.size());
+    compressor.finish();
+    auto end = std::chrono::steady_clock::now();
+
+    totalMicros += std::chrono::duration<double, std::micro>(end - start).count();
+  }
+  double micros = totalMicros / BENCH_ITERATIONS;
+
+  bool same = decode(out.data) == payload && count.getCount() == out.data.size();
+  printf("  %-8s in=%6zu out=%6zu ratio=%.2f saved=%4.1f%% encode=%8.1fus (%.1fus/KB) %s\n",
+    name, payload.size(), out.data.size(), (double)payload.size() / out.data.size(),
+    100.0 - 100.0 * out.data.size() / payload.size(), micros, micros * 1024 / payload.size(),
+    same ? "" : "ROUND TRIP FAILED");
+  return same;
+}
+
+int main(void)
+{
+  printf("heatshrink (%s) adopt payloads, %u iterations\n", HEATSHRINK_ENCODING, BENCH_ITERATIONS);
+
+  bool same = true;
+  same &= bench("library", 0);
+  same &= bench("typical", 20);
+  same &= bench("large", 80);
+  return same ? 0 : 1;
+}
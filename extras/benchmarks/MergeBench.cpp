@@ -0,0 +1,168 @@
+/*
+ * MergeBench.cpp
+ *
+ * Host micro-benchmark for mergeJson() (src/JsonMerge.h) against the
+ * recursive merge it replaced, over schemas about the size real firmware
+ * sets. Covers the three ways the library merges:
+ *
+ *   into empty     setConfigSchema()/setCommandSchema() (fresh document)
+ *   into library   adopt schema builders (firmware properties merged into
+ *                  the library's own, a few keys overlap)
+ *   into itself    the same schema merged over a copy of itself (every key
+ *                  already exists, nested objects merged key by key)
+ *
+ * Both merges must produce the same document (the schemas have no falsy
+ * values, which the recursive merge got wrong), this is checked first.
+ *
+ * Build (ArduinoJson 7 is header only):
+ *   g++ -std=c++17 -O2 -I../../src -I<path to ArduinoJson>/src MergeBench.cpp -o MergeBench
+ */
+
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include <ArduinoJson.h>
+
+#include "JsonMerge.h"
+
+#define       BENCH_PROPERTIES          80
+#define       BENCH_ITERATIONS          2000
+
+// The recursive merge as it was, for comparison
+void recursiveMerge(JsonVariant dst, JsonVariantConst src)
+{
+  if (src.is<JsonObjectConst>())
+  {
+    for (JsonPairConst kvp : src.as<JsonObjectConst>())
+    {
+      if (dst[kvp.key()])
+      {
+        recursiveMerge(dst[kvp.key()], kvp.value());
+      }
+      else
+      {
+        dst[kvp.key()] = kvp.value();
+      }
+    }
+  }
+  else
+  {
+    dst.set(src);
+  }
+}
+
+typedef void (*mergeFunction)(JsonVariant dst, JsonVariantConst src);
+
+void buildFirmwareSchema(JsonDocument & json)
+{
+  for (uint8_t i = 0; i < BENCH_PROPERTIES; i++)
+  {
+    char key[24];
+    snprintf(key, sizeof(key), "property%u", i);
+
+    JsonObject property = json[key].to<JsonObject>();
+    property["title"] = "A configurable property";
+    property["description"] = "Something firmware lets the user configure, with a longer description.";
+
+    // A mix of simple, ranged, enum and nested (array of object) properties
+    switch (i % 4)
+    {
+      case 0:
+        property["type"] = "boolean";
+        break;
+
+      case 1:
+        property["type"] = "integer";
+        property["minimum"] = 1;
+        property["maximum"] = 255;
+        break;
+
+      case 2:
+      {
+        JsonArray values = property["enum"].to<JsonArray>();
+        values.add("off");
+        values.add("on");
+        values.add("auto");
+        break;
+      }
+
+      case 3:
+      {
+        property["type"] = "array";
+        JsonObject items = property["items"].to<JsonObject>();
+        items["type"] = "object";
+        JsonObject properties = items["properties"].to<JsonObject>();
+        properties["index"]["type"] = "integer";
+        properties["index"]["minimum"] = 1;
+        properties["mode"]["type"] = "string";
+        break;
+      }
+    }
+  }
+
+  // Overlaps with the library's own properties
+  json["hassDiscoveryEnabled"]["description"] = "Overridden by firmware.";
+}
+
+void buildLibrarySchema(JsonDocument & json)
+{
+  JsonObject hassDiscoveryEnabled = json["hassDiscoveryEnabled"].to<JsonObject>();
+  hassDiscoveryEnabled["title"] = "Home Assistant Discovery";
+  hassDiscoveryEnabled["type"] = "boolean";
+
+  JsonObject hassDiscoveryTopicPrefix = json["hassDiscoveryTopicPrefix"].to<JsonObject>();
+  hassDiscoveryTopicPrefix["title"] = "Home Assistant Discovery Topic Prefix";
+  hassDiscoveryTopicPrefix["type"] = "string";
+}
+
+double timeMerge(mergeFunction merge, JsonDocument & src, void (*buildDst)(JsonDocument &), std::string * result)
+{
+  double totalMicros = 0;
+  for (uint16_t i = 0; i < BENCH_ITERATIONS; i++)
+  {
+    JsonDocument dst;
+    if (buildDst) { buildDst(dst); }
+
+    auto start = std::chrono::steady_clock::now();
+    merge(dst.as<JsonVariant>(), src.as<JsonVariantConst>());
+    auto end = std::chrono::steady_clock::now();
+
+    totalMicros += std::chrono::duration<double, std::micro>(end - start).count();
+    if (i == 0) { serializeJson(dst, *result); }
+  }
+  return totalMicros / BENCH_ITERATIONS;
+}
+
+JsonDocument firmwareSchema;
+
+void buildCopy(JsonDocument & json)
+{
+  json.set(firmwareSchema);
+}
+
+bool bench(const char * name, void (*buildDst)(JsonDocument &))
+{
+  std::string recursiveResult, mergeResult;
+  double recursiveMicros = timeMerge(recursiveMerge, firmwareSchema, buildDst, &recursiveResult);
+  double mergeMicros = timeMerge(mergeJson, firmwareSchema, buildDst, &mergeResult);
+
+  bool same = recursiveResult == mergeResult;
+  printf("  %-14s recursive=%8.1fus mergeJson=%8.1fus speedup=%.2fx %s\n",
+    name, recursiveMicros, mergeMicros, recursiveMicros / mergeMicros, same ? "" : "RESULTS DIFFER");
+  return same;
+}
+
+int main(void)
+{
+  buildFirmwareSchema(firmwareSchema);
+
+  std::string serialised;
+  serializeJson(firmwareSchema, serialised);
+  printf("firmware schema: %u properties, %u bytes serialised\n", BENCH_PROPERTIES, (unsigned)serialised.size());
+
+  bool same = true;
+  same &= bench("into empty", NULL);
+  same &= bench("into library", buildLibrarySchema);
+  same &= bench("into itself", buildCopy);
+  return same ? 0 : 1;
+}
@@ -0,0 +1,35 @@
+/*
+ * Print.h
+ *
+ * Minimal host stand-in for the Arduino core's Print, enough to build the
+ * library classes which only write to a Print (e.g. HeatshrinkPrint).
+ */
+
+#ifndef PRINT_H
+#define PRINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+class Print
+{
+  public:
+    virtual ~Print(void) {}
+
+    virtual size_t write(uint8_t character) = 0;
+    virtual size_t write(const uint8_t * buffer, size_t size)
+    {
+      size_t count = 0;
+      while (count < size && write(buffer[count])) { count++; }
+      return count;
+    }
+
+    size_t write(const char * string) { return write((const uint8_t *)string, strlen(string)); }
+    size_t print(const char * string) { return write(string); }
+
+    virtual int availableForWrite(void) { return 0; }
+    virtual void flush(void) {}
+};
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * Arduino.h
+ *
+ * Minimal host stand-in for the Arduino core, enough to build RestClient
+ * for the host tests. millis() is a fake clock the tests advance.
+ */
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "Print.h"
+
+#define       PSTR(s)                   (s)
+#define       snprintf_P                snprintf
+#define       strcpy_P                  strcpy
+
+template <typename T> T min(T a, T b) { return a < b ? a : b; }
+template <typename T> T max(T a, T b) { return a > b ? a : b; }
+
+inline size_t strlcpy(char * dst, const char * src, size_t size)
+{
+  size_t length = strlen(src);
+  if (size)
+  {
+    size_t copy = length < size - 1 ? length : size - 1;
+    memcpy(dst, src, copy);
+    dst[copy] = 0;
+  }
+  return length;
+}
+
+extern uint32_t hostMillis;
+inline uint32_t millis(void) { return hostMillis; }
+inline void yield(void) { hostMillis++; }
+
+class Stream : public Print
+{
+  public:
+    virtual int available(void) = 0;
+    virtual int read(void) = 0;
+    virtual int peek(void) = 0;
+};
+
+class IPAddress
+{
+  public:
+    IPAddress(void) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {}
+};
+
+#endif
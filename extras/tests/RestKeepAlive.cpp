@@ -0,0 +1,190 @@
+/*
+ * RestKeepAlive.cpp
+ *
+ * Host tests for RestClient keep-alive, run against a fake socket with
+ * pipelined requests:
+ *
+ *   304 then 200   an ETag 304 written without the API reading the request
+ *                  (as _restHandle does) keeps the connection, has no
+ *                  Content-Length and the 200 behind it is framed as usual
+ *   unread body    a response to a request whose body was never read closes
+ *                  the connection, rather than parsing the body as a request
+ *   pending input  a request pipelined behind the last is reported as
+ *                  pending (no socket event will be raised for it)
+ *
+ * Build (Arduino.h/Client.h here and ../benchmarks/Print.h stand in for the
+ * Arduino core):
+ *   g++ -std=c++17 -I. -I../benchmarks -I../../src RestKeepAlive.cpp ../../src/RestClient.cpp ../../src/HeatshrinkPrint.cpp -o RestKeepAlive
+ */
+
+#include <string>
+
+#include "RestClient.h"
+
+uint32_t hostMillis = 0;
+
+// Socket with everything the client sent already received, and room to write
+class FakeSocket : public Client
+{
+  public:
+    std::string in;
+    std::string out;
+    bool open = true;
+
+    int connect(IPAddress ip, uint16_t port) { return 0; }
+    int connect(const char * host, uint16_t port) { return 0; }
+    size_t write(uint8_t character) { out += (char)character; return 1; }
+    size_t write(const uint8_t * buffer, size_t size) { out.append((const char *)buffer, size); return size; }
+    int availableForWrite(void) { return 256; }
+    int available(void) { return in.size() - _position; }
+    int read(void) { return _position < in.size() ? (uint8_t)in[_position++] : -1; }
+    int read(uint8_t * buffer, size_t size)
+    {
+      size_t count = min(size, in.size() - _position);
+      memcpy(buffer, &in[_position], count);
+      _position += count;
+      return count ? count : -1;
+    }
+    int peek(void) { return _position < in.size() ? (uint8_t)in[_position] : -1; }
+    void flush(void) {}
+    void stop(void) { open = false; }
+    uint8_t connected(void) { return open; }
+    operator bool(void) { return open; }
+
+  private:
+    size_t _position = 0;
+};
+
+typedef void (*handler)(RestClient & rest);
+
+// Polls until the connection closes or has nothing left to serve
+void serve(RestClient & rest, handler handle)
+{
+  for (uint16_t i = 0; i < 100; i++)
+  {
+    RestClient::State state = rest.poll();
+    if (state == RestClient::REST_READY) { handle(rest); }
+    if (state == RestClient::REST_IDLE) { return; }
+    hostMillis++;
+  }
+}
+
+void readHead(RestClient & rest)
+{
+  std::string head;
+  while (head.find("\r\n\r\n") == std::string::npos)
+  {
+    int character = rest.read();
+    if (character < 0) { break; }
+    head += (char)character;
+  }
+}
+
+uint8_t failures = 0;
+
+void check(const char * name, bool passed)
+{
+  printf("  %-50s %s\n", name, passed ? "ok" : "FAILED");
+  if (!passed) { failures++; }
+}
+
+/* 304 then 200 */
+void handleEtag(RestClient & rest)
+{
+  if (rest.isRequest("GET", "/adopt"))
+  {
+    rest.skipRequest();
+    rest.print("HTTP/1.1 304 Not Modified\r\nETag: W/\"1234abcd\"\r\nVary: Accept-Encoding\r\n\r\n");
+  }
+  else
+  {
+    readHead(rest);
+    rest.print("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\nhello");
+  }
+  rest.stop();
+}
+
+void testNotModified(void)
+{
+  FakeSocket socket;
+  socket.in = "GET /adopt HTTP/1.1\r\nIf-None-Match: W/\"1234abcd\"\r\n\r\nGET /status HTTP/1.1\r\n\r\n";
+
+  RestClient rest;
+  rest.begin(&socket);
+  serve(rest, handleEtag);
+
+  size_t split = socket.out.find("HTTP/1.1 200");
+  std::string notModified = socket.out.substr(0, split);
+  std::string ok = split == std::string::npos ? "" : socket.out.substr(split);
+
+  printf("304 then 200\n");
+  check("304 keeps the connection", notModified.find("Connection: keep-alive\r\n") != std::string::npos);
+  check("304 has no Content-Length", notModified.find("Content-Length") == std::string::npos);
+  check("pipelined 200 is served", ok.find("\r\n\r\nhello") != std::string::npos);
+  check("200 has a Content-Length", ok.find("Content-Length: 5\r\n") != std::string::npos);
+  check("connection still open", socket.open && rest.getState() == RestClient::REST_READING);
+}
+
+/* Unread body */
+uint8_t bodyRequests = 0;
+
+void handleIgnoreBody(RestClient & rest)
+{
+  bodyRequests++;
+  readHead(rest);
+  rest.print("HTTP/1.1 200 OK\r\n\r\nignored");
+  rest.stop();
+}
+
+void testUnreadBody(void)
+{
+  FakeSocket socket;
+  socket.in = "POST /api HTTP/1.1\r\nContent-Length: 22\r\n\r\nGET /evil HTTP/1.1\r\n\r\n";
+
+  RestClient rest;
+  rest.begin(&socket);
+  serve(rest, handleIgnoreBody);
+
+  printf("unread body\n");
+  check("response closes the connection", socket.out.find("Connection: close\r\n") != std::string::npos && !socket.open);
+  check("body not served as a request", bodyRequests == 1);
+}
+
+/* Pending input */
+void handleHello(RestClient & rest)
+{
+  readHead(rest);
+  rest.print("HTTP/1.1 200 OK\r\n\r\nhello");
+  rest.stop();
+}
+
+void testPendingInput(void)
+{
+  FakeSocket socket;
+  socket.in = "GET /a HTTP/1.1\r\n\r\nGET /b HTTP/1.1\r\n\r\nGET /c HTTP/1.1\r\n";
+
+  RestClient rest;
+  rest.begin(&socket);
+
+  // Serve /a and drain its response, /b is then waiting in our buffer
+  bool pipelined = rest.poll() == RestClient::REST_READY;
+  handleHello(rest);
+  pipelined = pipelined && rest.poll() == RestClient::REST_READING && rest.hasPendingInput();
+
+  // Serve /b, only part of /c has arrived so there is nothing to do until it does
+  bool partial = rest.poll() == RestClient::REST_READY;
+  handleHello(rest);
+  partial = partial && rest.poll() == RestClient::REST_READING && !rest.hasPendingInput();
+
+  printf("pending input\n");
+  check("pipelined request is pending", pipelined);
+  check("partial request is not pending", partial);
+}
+
+int main(void)
+{
+  testNotModified();
+  testUnreadBody();
+  testPendingInput();
+  return failures ? 1 : 0;
+}
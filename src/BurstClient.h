@@ -0,0 +1,169 @@
+/*
+ * BurstClient.h
+ */
+
+#ifndef BURST_CLIENT_H
+#define BURST_CLIENT_H
+
+#include <Arduino.h>
+#include <Client.h>
+
+// Wraps a network client so data moves in bursts rather than a byte at a
+// time. On the W5500 every socket read/write is several SPI transactions
+// (plus a SEND/RECV command), so per-byte reads (PubSubClient) and writes
+// (streaming serialisers) are very expensive.
+//
+// Reads are always buffered. Writes are only coalesced between begin() and
+// end(), since PubSubClient expects its own packets to go out straight away.
+template <uint16_t RX_SIZE, uint16_t TX_SIZE>
+class BurstClient : public Client
+{
+  public:
+    BurstClient(Client & client) : _client(client) {}
+
+    // Coalesce writes until end()
+    void begin(void) { _bursting = true; }
+    bool end(void)
+    {
+      _bursting = false;
+      return _flushTx();
+    }
+
+    // Socket operations vs bytes moved
+    uint32_t getSocketReads(void) { return _socketReads; }
+    uint32_t getBytesRead(void) { return _bytesRead; }
+    uint32_t getSocketWrites(void) { return _socketWrites; }
+    uint32_t getBytesWritten(void) { return _bytesWritten; }
+
+    int connect(IPAddress ip, uint16_t port)
+    {
+      _reset();
+      return _client.connect(ip, port);
+    }
+
+    int connect(const char * host, uint16_t port)
+    {
+      _reset();
+      return _client.connect(host, port);
+    }
+
+    size_t write(uint8_t character) { return write(&character, 1); }
+    size_t write(const uint8_t * buffer, size_t size)
+    {
+      if (!_bursting) { return _write(buffer, size); }
+
+      // Make room, anything bigger than our buffer goes straight out
+      if (_txLength + size > TX_SIZE && !_flushTx()) { return 0; }
+      if (size >= TX_SIZE) { return _write(buffer, size); }
+
+      memcpy(&_tx[_txLength], buffer, size);
+      _txLength += size;
+      return size;
+    }
+
+    int available(void)
+    {
+      // Only touch the socket once our buffer is empty
+      if (_rxPosition < _rxLength) { return _rxLength - _rxPosition; }
+      return _client.available();
+    }
+
+    int read(void)
+    {
+      if (_rxPosition >= _rxLength && !_fillRx()) { return -1; }
+      return _rx[_rxPosition++];
+    }
+
+    int read(uint8_t * buffer, size_t size)
+    {
+      size_t count = 0;
+      while (count < size && (_rxPosition < _rxLength || _fillRx()))
+      {
+        size_t chunk = min(size - count, (size_t)(_rxLength - _rxPosition));
+        memcpy(&buffer[count], &_rx[_rxPosition], chunk);
+        _rxPosition += chunk;
+        count += chunk;
+      }
+      return count ? count : -1;
+    }
+
+    int peek(void)
+    {
+      if (_rxPosition >= _rxLength && !_fillRx()) { return -1; }
+      return _rx[_rxPosition];
+    }
+
+    void flush(void)
+    {
+      _flushTx();
+      _client.flush();
+    }
+
+    void stop(void)
+    {
+      _reset();
+      _client.stop();
+    }
+
+    uint8_t connected(void) { return _rxPosition < _rxLength || _client.connected(); }
+    operator bool(void) { return (bool)_client; }
+
+  private:
+    Client & _client;
+
+    uint8_t _rx[RX_SIZE];
+    uint16_t _rxPosition = 0;
+    uint16_t _rxLength = 0;
+
+    uint8_t _tx[TX_SIZE];
+    uint16_t _txLength = 0;
+    bool _bursting = false;
+
+    uint32_t _socketReads = 0;
+    uint32_t _bytesRead = 0;
+    uint32_t _socketWrites = 0;
+    uint32_t _bytesWritten = 0;
+
+    bool _fillRx(void)
+    {
+      int available = _client.available();
+      if (available <= 0) { return false; }
+
+      int count = _client.read(_rx, min((size_t)available, sizeof(_rx)));
+      if (count <= 0) { return false; }
+
+      _socketReads++;
+      _bytesRead += count;
+
+      _rxPosition = 0;
+      _rxLength = count;
+      return true;
+    }
+
+    size_t _write(const uint8_t * buffer, size_t size)
+    {
+      size_t written = _client.write(buffer, size);
+
+      _socketWrites++;
+      _bytesWritten += written;
+      return written;
+    }
+
+    bool _flushTx(void)
+    {
+      if (!_txLength) { return true; }
+
+      size_t length = _txLength;
+      _txLength = 0;
+      return _write(_tx, length) == length;
+    }
+
+    void _reset(void)
+    {
+      _rxPosition = _rxLength = 0;
+      _txLength = 0;
+      _bursting = false;
+    }
+};
+
+#endif
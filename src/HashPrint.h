@@ -0,0 +1,29 @@
+/*
+ * HashPrint.h
+ */
+
+#ifndef HASH_PRINT_H
+#define HASH_PRINT_H
+
+#include <Print.h>
+
+// Print sink which FNV-1a hashes everything written to it, so JSON can be
+// hashed by serialising straight into it without buffering
+class HashPrint : public Print
+{
+  public:
+    virtual size_t write(uint8_t character)
+    {
+      _hash = (_hash ^ character) * 16777619UL;
+      return 1;
+    }
+
+    using Print::write;
+
+    uint32_t getHash(void) { return _hash; }
+
+  private:
+    uint32_t _hash = 2166136261UL;
+};
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ * HeatshrinkPrint.cpp
+ */
+
+#include "HeatshrinkPrint.h"
+
+// Tag bits (as per the heatshrink format)
+#define       HEATSHRINK_LITERAL_MARKER 1
+#define       HEATSHRINK_BACKREF_MARKER 0
+
+// A backref costs 1 + 8 + 4 bits, so only worth it for 2+ bytes
+#define       HEATSHRINK_MIN_MATCH      2
+
+HeatshrinkPrint::HeatshrinkPrint(Print & out)
+{
+  begin(out);
+}
+
+void HeatshrinkPrint::begin(Print & out)
+{
+  _out = &out;
+
+  _windowCount = 0;
+  _windowHead = 0;
+  _lookaheadCount = 0;
+  _bitBuffer = 0;
+  _bitCount = 0;
+  _bytesIn = 0;
+  _bytesOut = 0;
+}
+
+size_t HeatshrinkPrint::write(uint8_t character)
+{
+  _lookahead[_lookaheadCount++] = character;
+  _bytesIn++;
+
+  // Only encode once the lookahead is full so we find the longest matches
+  if (_lookaheadCount == LOOKAHEAD_SIZE)
+  {
+    _encodeToken();
+  }
+  return 1;
+}
+
+void HeatshrinkPrint::finish(void)
+{
+  while (_lookaheadCount)
+  {
+    _encodeToken();
+  }
+
+  // Pad the last byte with zeros
+  if (_bitCount)
+  {
+    _bytesOut += _out->write((uint8_t)(_bitBuffer << (8 - _bitCount)));
+    _bitBuffer = 0;
+    _bitCount = 0;
+  }
+}
+
+void HeatshrinkPrint::_encodeToken(void)
+{
+  // Brute force search of the window for the longest match
+  uint8_t bestLength = 0;
+  uint16_t bestDistance = 0;
+
+  for (uint16_t distance = 1; distance <= _windowCount; distance++)
+  {
+    // Matches don't overlap the lookahead, so are never longer than the distance
+    uint8_t maxLength = distance < _lookaheadCount ? distance : _lookaheadCount;
+
+    uint8_t length = 0;
+    while (length < maxLength && _window[(uint8_t)(_windowHead - distance + length)] == _lookahead[length])
+    {
+      length++;
+    }
+
+    if (length > bestLength)
+    {
+      bestLength = length;
+      bestDistance = distance;
+      if (length == _lookaheadCount) { break; }
+    }
+  }
+
+  uint8_t consumed;
+  if (bestLength >= HEATSHRINK_MIN_MATCH)
+  {
+    _emitBits(HEATSHRINK_BACKREF_MARKER, 1);
+    _emitBits(bestDistance - 1, HEATSHRINK_WINDOW_BITS);
+    _emitBits(bestLength - 1, HEATSHRINK_LOOKAHEAD_BITS);
+    consumed = bestLength;
+  }
+  else
+  {
+    _emitBits(HEATSHRINK_LITERAL_MARKER, 1);
+    _emitBits(_lookahead[0], 8);
+    consumed = 1;
+  }
+
+  // Move the encoded bytes into the window
+  for (uint8_t i = 0; i < consumed; i++)
+  {
+    _window[_windowHead++] = _lookahead[i];
+  }
+  _windowCount += consumed;
+  if (_windowCount > WINDOW_SIZE) { _windowCount = WINDOW_SIZE; }
+
+  _lookaheadCount -= consumed;
+  memmove(_lookahead, &_lookahead[consumed], _lookaheadCount);
+}
+
+void HeatshrinkPrint::_emitBits(uint16_t value, uint8_t bits)
+{
+  // Most significant bit first
+  while (bits--)
+  {
+    _bitBuffer = (_bitBuffer << 1) | ((value >> bits) & 1);
+
+    if (++_bitCount == 8)
+    {
+      _bytesOut += _out->write(_bitBuffer);
+      _bitBuffer = 0;
+      _bitCount = 0;
+    }
+  }
+}
@@ -0,0 +1,72 @@
+/*
+ * HeatshrinkPrint.h
+ */
+
+#ifndef HEATSHRINK_PRINT_H
+#define HEATSHRINK_PRINT_H
+
+#include <Print.h>
+
+// Window 2^8 bytes, lookahead 2^4 bytes (decode with heatshrink -w 8 -l 4)
+#define       HEATSHRINK_WINDOW_BITS    8
+#define       HEATSHRINK_LOOKAHEAD_BITS 4
+#define       HEATSHRINK_ENCODING       "heatshrink-w8-l4"
+
+// Streaming heatshrink (LZSS) encoder, compresses everything written to it
+// into another Print using a fixed ~280 byte working buffer
+class HeatshrinkPrint : public Print
+{
+  public:
+    HeatshrinkPrint(void) {}
+    HeatshrinkPrint(Print & out);
+
+    // (Re)start compressing into out
+    void begin(Print & out);
+
+    virtual size_t write(uint8_t character);
+    using Print::write;
+
+    // Encode whatever is left and pad the final byte, call once at the end
+    void finish(void);
+
+    // Bytes written to us, and bytes out accepted
+    size_t getBytesIn(void) { return _bytesIn; }
+    size_t getBytesOut(void) { return _bytesOut; }
+
+  private:
+    static const uint16_t WINDOW_SIZE = 1 << HEATSHRINK_WINDOW_BITS;
+    static const uint8_t LOOKAHEAD_SIZE = 1 << HEATSHRINK_LOOKAHEAD_BITS;
+
+    Print * _out = NULL;
+
+    uint8_t _window[WINDOW_SIZE];
+    uint16_t _windowCount = 0;
+    uint8_t _windowHead = 0;
+
+    uint8_t _lookahead[LOOKAHEAD_SIZE];
+    uint8_t _lookaheadCount = 0;
+
+    uint8_t _bitBuffer = 0;
+    uint8_t _bitCount = 0;
+
+    size_t _bytesIn = 0;
+    size_t _bytesOut = 0;
+
+    void _encodeToken(void);
+    void _emitBits(uint16_t value, uint8_t bits);
+};
+
+// Print sink which only counts bytes, for sizing a compressed payload
+class CountPrint : public Print
+{
+  public:
+    virtual size_t write(uint8_t character) { _count++; return 1; }
+    using Print::write;
+
+    size_t getCount(void) { return _count; }
+
+  private:
+    size_t _count = 0;
+};
+
+#endif
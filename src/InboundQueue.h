@@ -0,0 +1,132 @@
+/*
+ * InboundQueue.h
+ */
+
+#ifndef INBOUND_QUEUE_H
+#define INBOUND_QUEUE_H
+
+#include <Arduino.h>
+
+// Preallocated FIFO of raw MQTT messages, each record is stored contiguously
+// so the payload can be deserialised in place. Topics are matched before
+// queueing so only a one byte topic kind is stored with each payload.
+template <uint16_t SIZE>
+class InboundQueue
+{
+  public:
+    // Returns false (and counts a drop) if there is no room for the message
+    bool push(uint8_t kind, const byte * payload, uint16_t length)
+    {
+      uint16_t recordSize = HEADER_SIZE + length;
+
+      byte * record = _reserve(recordSize);
+      if (!record)
+      {
+        _dropped++;
+        return false;
+      }
+
+      memcpy(record, &recordSize, sizeof(uint16_t));
+      memcpy(record + sizeof(uint16_t), &length, sizeof(uint16_t));
+      record[2 * sizeof(uint16_t)] = kind;
+      memcpy(record + HEADER_SIZE, payload, length);
+
+      _count++;
+      return true;
+    }
+
+    // Points at the oldest message, which stays valid until pop()
+    bool peek(uint8_t * kind, byte ** payload, uint16_t * length)
+    {
+      if (!_count) { return false; }
+
+      // Skip the unused tail end if the writer wrapped
+      uint16_t recordSize = _recordSizeAt(_head);
+      if (!recordSize)
+      {
+        _head = 0;
+      }
+
+      byte * record = &_buffer[_head];
+      memcpy(length, record + sizeof(uint16_t), sizeof(uint16_t));
+      *kind = record[2 * sizeof(uint16_t)];
+      *payload = record + HEADER_SIZE;
+      return true;
+    }
+
+    void pop(void)
+    {
+      if (!_count) { return; }
+
+      if (!_recordSizeAt(_head)) { _head = 0; }
+      _head += _recordSizeAt(_head);
+
+      // Start from the beginning again whenever we empty
+      if (--_count == 0)
+      {
+        _head = 0;
+        _tail = 0;
+      }
+    }
+
+    bool isEmpty(void) { return _count == 0; }
+    uint16_t getCount(void) { return _count; }
+    uint32_t getDropped(void) { return _dropped; }
+
+  private:
+    // Record size, payload length and topic kind
+    static const uint16_t HEADER_SIZE = 2 * sizeof(uint16_t) + 1;
+
+    byte _buffer[SIZE];
+    uint16_t _head = 0;
+    uint16_t _tail = 0;
+    uint16_t _count = 0;
+    uint32_t _dropped = 0;
+
+    // Record size at offset, 0 means the writer wrapped back to the start
+    uint16_t _recordSizeAt(uint16_t offset)
+    {
+      if (SIZE - offset < HEADER_SIZE) { return 0; }
+
+      uint16_t recordSize;
+      memcpy(&recordSize, &_buffer[offset], sizeof(uint16_t));
+      return recordSize;
+    }
+
+    byte * _reserve(uint16_t size)
+    {
+      if (!_count || _tail > _head)
+      {
+        // Free space is after the tail and (if we wrap) before the head
+        if (SIZE - _tail >= size)
+        {
+          byte * record = &_buffer[_tail];
+          _tail += size;
+          return record;
+        }
+
+        // Need a gap between tail and head so full/empty are distinguishable
+        if (_count && _head > size)
+        {
+          if (SIZE - _tail >= HEADER_SIZE)
+          {
+            uint16_t marker = 0;
+            memcpy(&_buffer[_tail], &marker, sizeof(uint16_t));
+          }
+          _tail = size;
+          return &_buffer[0];
+        }
+      }
+      else if (_head - _tail > size)
+      {
+        // Free space is between the tail and head
+        byte * record = &_buffer[_tail];
+        _tail += size;
+        return record;
+      }
+
+      return NULL;
+    }
+};
+
+#endif
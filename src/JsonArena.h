@@ -0,0 +1,132 @@
+/*
+ * JsonArena.h
+ */
+
+#ifndef JSON_ARENA_H
+#define JSON_ARENA_H
+
+#include <ArduinoJson.h>
+
+// Preallocated bump allocator for short-lived JsonDocuments. Memory is
+// reclaimed when the most recent block is freed, or all at once when every
+// block is freed, so the heap never sees these allocations (unless the
+// arena is full, in which case we fall back to the heap, or the allocator
+// given, and count it).
+template <size_t SIZE>
+class JsonArena : public ArduinoJson::Allocator
+{
+  public:
+    JsonArena(ArduinoJson::Allocator * fallback = NULL) : _fallback(fallback) {}
+
+    void * allocate(size_t size) override
+    {
+      size_t need = HEADER_SIZE + _align(size);
+      if (_used + need > SIZE)
+      {
+        _overflows++;
+        return _fallback ? _fallback->allocate(size) : malloc(size);
+      }
+
+      byte * block = &_buffer[_used + HEADER_SIZE];
+      _setSize(block, size);
+
+      _last = block;
+      _used += need;
+      _live++;
+
+      if (_used > _highWater) { _highWater = _used; }
+      return block;
+    }
+
+    void deallocate(void * pointer) override
+    {
+      if (!_owns(pointer))
+      {
+        if (_fallback) { _fallback->deallocate(pointer); } else { free(pointer); }
+        return;
+      }
+
+      // Roll back if this was the last block handed out
+      if (pointer == _last)
+      {
+        _used = (byte *)pointer - _buffer - HEADER_SIZE;
+        _last = NULL;
+      }
+
+      // Everything has been released so start again
+      if (--_live == 0)
+      {
+        _used = 0;
+        _last = NULL;
+      }
+    }
+
+    void * reallocate(void * pointer, size_t size) override
+    {
+      if (!pointer) { return allocate(size); }
+      if (!_owns(pointer)) { return _fallback ? _fallback->reallocate(pointer, size) : realloc(pointer, size); }
+
+      // Grow/shrink in place if this is the last block and it still fits
+      size_t offset = (byte *)pointer - _buffer;
+      if (pointer == _last && offset + _align(size) <= SIZE)
+      {
+        _setSize((byte *)pointer, size);
+        _used = offset + _align(size);
+
+        if (_used > _highWater) { _highWater = _used; }
+        return pointer;
+      }
+
+      // On failure the caller still owns (and frees) the original block
+      void * moved = allocate(size);
+      if (!moved) { return NULL; }
+
+      size_t oldSize = _getSize((byte *)pointer);
+      memcpy(moved, pointer, oldSize < size ? oldSize : size);
+      deallocate(pointer);
+      return moved;
+    }
+
+    size_t getUsed(void) { return _used; }
+    size_t getHighWater(void) { return _highWater; }
+    uint32_t getOverflows(void) { return _overflows; }
+
+  private:
+    // Each block is prefixed by its size, keeping 8 byte alignment for doubles
+    static const size_t ALIGNMENT = 8;
+    static const size_t HEADER_SIZE = ALIGNMENT;
+
+    ArduinoJson::Allocator * _fallback;
+
+    alignas(ALIGNMENT) byte _buffer[SIZE];
+    size_t _used = 0;
+    byte * _last = NULL;
+    uint16_t _live = 0;
+
+    size_t _highWater = 0;
+    uint32_t _overflows = 0;
+
+    static size_t _align(size_t size)
+    {
+      return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    bool _owns(void * pointer)
+    {
+      return (byte *)pointer >= _buffer && (byte *)pointer < _buffer + SIZE;
+    }
+
+    void _setSize(byte * block, size_t size)
+    {
+      memcpy(block - HEADER_SIZE, &size, sizeof(size_t));
+    }
+
+    size_t _getSize(byte * block)
+    {
+      size_t size;
+      memcpy(&size, block - HEADER_SIZE, sizeof(size_t));
+      return size;
+    }
+};
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * JsonMerge.h
+ */
+
+#ifndef JSON_MERGE_H
+#define JSON_MERGE_H
+
+#include <ArduinoJson.h>
+
+// Deepest nesting mergeJson() merges key by key (anything deeper is replaced)
+#ifndef MERGE_MAX_DEPTH
+#define       MERGE_MAX_DEPTH           10
+#endif
+
+// Merge src into dst - objects are merged key by key, anything else replaces
+// what is already there. Keys already in dst are looked up once, new keys twice
+// (ArduinoJson has no way to add a member without searching for it first).
+inline void mergeJson(JsonVariant dst, JsonVariantConst src)
+{
+  // Anything other than an object, or merging into an empty/non-object, is a straight copy
+  if (!src.is<JsonObjectConst>() || !dst.is<JsonObject>() || dst.size() == 0)
+  {
+    dst.set(src);
+    return;
+  }
+
+  // Depth first walk using an explicit stack of object iterators
+  struct MergeFrame
+  {
+    JsonObject dst;
+    JsonObjectConst::iterator it;
+    JsonObjectConst::iterator end;
+  };
+
+  MergeFrame stack[MERGE_MAX_DEPTH];
+  uint8_t depth = 0;
+
+  JsonObjectConst root = src.as<JsonObjectConst>();
+  stack[depth++] = { dst.as<JsonObject>(), root.begin(), root.end() };
+
+  while (depth)
+  {
+    MergeFrame * frame = &stack[depth - 1];
+    if (frame->it == frame->end)
+    {
+      depth--;
+      continue;
+    }
+
+    JsonPairConst kvp = *frame->it;
+    ++frame->it;
+
+    // Unbound if the key doesn't exist yet (falsy values still exist)
+    JsonVariant existing = frame->dst[kvp.key()];
+    JsonVariantConst value = kvp.value();
+
+    if (existing.isUnbound())
+    {
+      frame->dst[kvp.key()] = value;
+    }
+    else if (value.is<JsonObjectConst>() && existing.is<JsonObject>() && existing.size() > 0 && depth < MERGE_MAX_DEPTH)
+    {
+      JsonObjectConst child = value.as<JsonObjectConst>();
+      stack[depth++] = { existing.as<JsonObject>(), child.begin(), child.end() };
+    }
+    else
+    {
+      existing.set(value);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * KeyDispatcher.h
+ */
+
+#ifndef KEY_DISPATCHER_H
+#define KEY_DISPATCHER_H
+
+#include <OXRS_MQTT.h>                // For jsonCallback
+
+// FNV-1a hash, constexpr so literal keys can be hashed at compile time
+constexpr uint32_t keyHash(const char * key, uint32_t hash = 2166136261UL)
+{
+  return *key ? keyHash(key + 1, (hash ^ (uint8_t)*key) * 16777619UL) : hash;
+}
+
+// Fixed size table of key -> handler, kept sorted by key hash so each
+// lookup is a binary search regardless of how many keys are registered
+template <uint8_t SIZE>
+class KeyDispatcher
+{
+  public:
+    bool add(const char * key, jsonCallback callback)
+    {
+      return add(keyHash(key), key, callback);
+    }
+
+    bool add(uint32_t hash, const char * key, jsonCallback callback)
+    {
+      // Replace the handler if this key is already registered
+      int index = _find(hash, key);
+      if (index >= 0)
+      {
+        _handlers[index].callback = callback;
+        return true;
+      }
+
+      if (_count >= SIZE) { return false; }
+
+      // Insert in hash order
+      uint8_t i = _count++;
+      while (i > 0 && _handlers[i - 1].hash > hash)
+      {
+        _handlers[i] = _handlers[i - 1];
+        i--;
+      }
+
+      _handlers[i].hash = hash;
+      _handlers[i].key = key;
+      _handlers[i].callback = callback;
+      return true;
+    }
+
+    // Walk the object once, passing each value to the handler for its key,
+    // returns the number of keys which had a handler
+    uint8_t dispatch(JsonVariant json)
+    {
+      if (!_count || !json.is<JsonObject>()) { return 0; }
+
+      uint8_t handled = 0;
+      for (JsonPair kvp : json.as<JsonObject>())
+      {
+        const char * key = kvp.key().c_str();
+        int index = _find(keyHash(key), key);
+        if (index >= 0)
+        {
+          _handlers[index].callback(kvp.value());
+          handled++;
+        }
+      }
+      return handled;
+    }
+
+  private:
+    struct Handler
+    {
+      uint32_t hash;
+      const char * key;
+      jsonCallback callback;
+    };
+
+    Handler _handlers[SIZE];
+    uint8_t _count = 0;
+
+    int _find(uint32_t hash, const char * key)
+    {
+      // Lower bound on hash, then check the key to rule out collisions
+      uint8_t lo = 0, hi = _count;
+      while (lo < hi)
+      {
+        uint8_t mid = (lo + hi) / 2;
+        if (_handlers[mid].hash < hash) { lo = mid + 1; } else { hi = mid; }
+      }
+
+      for (; lo < _count && _handlers[lo].hash == hash; lo++)
+      {
+        if (strcmp(_handlers[lo].key, key) == 0) { return lo; }
+      }
+      return -1;
+    }
+};
+
+#endif
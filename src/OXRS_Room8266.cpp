@@ -5,105 +5,196 @@
 #include "Arduino.h"
 #include "OXRS_Room8266.h"
 
-#include <ESP8266WiFi.h>              // For networking
-#include <Ethernet.h>                 // For networking
-#include <Adafruit_NeoPixel.h>        // For RGBW LED
 #include <LittleFS.h>                 // For file system access
-#include <MqttLogger.h>               // For logging
-
-#if defined(WIFI_MODE)
-#include <WiFiManager.h>              // For WiFi AP config
-#endif
+#include "HashPrint.h"                // For hashing adoption content
+#include "HeatshrinkPrint.h"          // For compressed adoption payloads
+#include "JsonMerge.h"                // For merging firmware/library schemas
 
 // Macro for converting env vars to strings
 #define STRINGIFY(s) STRINGIFY1(s)
 #define STRINGIFY1(s) #s
 
-// Network client (for MQTT)/server (for REST API)
-#if defined(WIFI_MODE)
-WiFiClient _client;
-WiFiServer _server(REST_API_PORT);
-#else
-EthernetClient _client;
-EthernetServer _server(REST_API_PORT);
-#endif
+// Device currently in begin()/loop(), see the callback wrappers below
+OXRS_Room8266 * OXRS_Room8266::_instance = NULL;
 
-// MQTT client
-PubSubClient _mqttClient(_client);
-OXRS_MQTT _mqtt(_mqttClient);
+/* Clock */
+uint32_t OXRS_Room8266::_millis(void)
+{
+  return _clockMillis ? _clockMillis() : millis();
+}
 
-// REST API
-OXRS_API _api(_mqtt);
+void OXRS_Room8266::_delay(uint32_t ms)
+{
+  if (_clockDelay) { _clockDelay(ms); } else { delay(ms); }
+}
 
-// RGBW LED (actually GRBW)
-Adafruit_NeoPixel _led(LED_COUNT, LED_PIN, NEO_GRBW);
+/* LED helpers */
+void OXRS_Room8266::_ledRGBW(uint8_t r, uint8_t g, uint8_t b, uint8_t w)
+{
+  _led.setPixelColor(0, r, g, b, w);
+  _led.show();
+}
 
-// Logging (topic updated once MQTT connects successfully)
-MqttLogger _logger(_mqttClient, "log", MqttLoggerMode::MqttAndSerial);
+void OXRS_Room8266::_ledRx(void)
+{
+  // yellow
+  _ledRGBW(255, 255, 0, 0);
+  _ledOnMillis = _millis();
+}
 
-// Supported firmware config and command schemas
-JsonDocument _fwConfigSchema;
-JsonDocument _fwCommandSchema;
+void OXRS_Room8266::_ledTx(void)
+{
+  // orange
+  _ledRGBW(255, 100, 0, 0);
+  _ledOnMillis = _millis();
+}
 
-// MQTT callbacks wrapped by _mqttConfig/_mqttCommand
-jsonCallback _onConfig;
-jsonCallback _onCommand;
+/* Backoff helpers */
+uint32_t OXRS_Room8266::_jitter(uint32_t range)
+{
+  // xorshift32
+  _jitterState ^= _jitterState << 13;
+  _jitterState ^= _jitterState >> 17;
+  _jitterState ^= _jitterState << 5;
+  return range ? _jitterState % range : 0;
+}
 
-// LED timer
-uint32_t _ledOnMillis = 0L;
+void OXRS_Room8266::_mqttReconnectAttempted(bool success)
+{
+  _mqttLastAttemptMillis = _millis();
 
-// stack size counter (for determine used heap size on ESP8266)
-char * _stack_start;
+  if (success)
+  {
+    _mqttReconnects++;
+    _mqttBackoffCount = 0;
+    _mqttBackoffMs = 0L;
+    return;
+  }
 
-/* Dirty hack to work out how much program space we are using */
-uint32_t getStackSize()
+  _mqttReconnectAttempts++;
+
+  // Double the delay each time (up to the max), then pick somewhere in the top half
+  uint32_t backoffMs = _mqttBackoffMaxMs;
+  if (_mqttBackoffCount < 16 && _mqttBackoffBaseMs < (_mqttBackoffMaxMs >> _mqttBackoffCount))
+  {
+    backoffMs = _mqttBackoffBaseMs << _mqttBackoffCount;
+    _mqttBackoffCount++;
+  }
+  _mqttBackoffMs = (backoffMs / 2) + _jitter(backoffMs / 2 + 1);
+}
+
+/* Network events */
+const char * _getNetworkEventName(uint8_t event)
 {
-  char stack;
-  return (uint32_t)_stack_start - (uint32_t)&stack;  
+  switch (event)
+  {
+    case NETWORK_LINK_UP:           return "link up";
+    case NETWORK_LINK_DOWN:         return "link down";
+    case NETWORK_DHCP_ACQUIRED:     return "dhcp lease acquired";
+    case NETWORK_DHCP_RENEWED:      return "dhcp lease renewed";
+    case NETWORK_DHCP_LOST:         return "dhcp lease lost";
+    case NETWORK_IP_CHANGED:        return "ip address changed";
+    case NETWORK_MQTT_CONNECTED:    return "mqtt connected";
+    case NETWORK_MQTT_DISCONNECTED: return "mqtt disconnected";
+  }
+  return "unknown";
 }
 
-/* JSON helpers */
-void _mergeJson(JsonVariant dst, JsonVariantConst src)
+void OXRS_Room8266::_raiseNetworkEvent(uint8_t event)
 {
-  if (src.is<JsonObjectConst>())
+  _logger.print(F("[room] network event: "));
+  _logger.println(_getNetworkEventName(event));
+
+  for (uint8_t i = 0; i < _networkHandlerCount; i++)
   {
-    for (JsonPairConst kvp : src.as<JsonObjectConst>())
-    {
-      if (dst[kvp.key()])
-      {
-        _mergeJson(dst[kvp.key()], kvp.value());
-      }
-      else
-      {
-        dst[kvp.key()] = kvp.value();
-      }
-    }
+    _networkHandlers[i](event);
   }
-  else
+}
+
+void OXRS_Room8266::_checkNetworkIP(void)
+{
+  IPAddress ip = _transport.localIP();
+  if (ip == _networkIP) { return; }
+
+  _networkIP = ip;
+  _raiseNetworkEvent(NETWORK_IP_CHANGED);
+}
+
+void OXRS_Room8266::_updateMqttState(bool connected)
+{
+  if (connected == _mqttWasConnected) { return; }
+  _mqttWasConnected = connected;
+
+  if (connected)
   {
-    dst.set(src);
+    _raiseNetworkEvent(NETWORK_MQTT_CONNECTED);
+    return;
   }
+
+  // Just lost the broker, spread our first retry over the base interval
+  _mqttLastAttemptMillis = _millis();
+  _mqttBackoffMs = _jitter(_mqttBackoffBaseMs);
+
+  _raiseNetworkEvent(NETWORK_MQTT_DISCONNECTED);
 }
 
-/* LED helpers */
-void _ledRGBW(uint8_t r, uint8_t g, uint8_t b, uint8_t w)
+/* MessagePack helpers */
+bool _isMsgPackMap(byte first)
 {
-  _led.setPixelColor(0, r, g, b, w);
-  _led.show();
+  // fixmap, map16 or map32 - JSON payloads always start with '{' or whitespace
+  return (first & 0xF0) == 0x80 || first == 0xDE || first == 0xDF;
 }
 
-void _ledRx(void)
+bool OXRS_Room8266::_publishJson(JsonVariant json, char * topic, bool retained)
 {
-  // yellow
-  _ledRGBW(255, 255, 0, 0);
-  _ledOnMillis = millis();
+  // Stream straight into the MQTT client so payload size isn't limited by its buffer
+  size_t length = measureJson(json);
+  if (!_mqttClient.beginPublish(topic, length, retained)) { return false; }
+
+  // The serialiser writes a few bytes at a time, so send it on in bursts
+  _burstClient.begin();
+  size_t written = serializeJson(json, _mqttClient);
+  bool flushed = _burstClient.end();
+  _mqttClient.endPublish();
+
+  // endPublish() always succeeds, so check everything actually went out
+  return written == length && flushed;
 }
 
-void _ledTx(void)
+bool OXRS_Room8266::_publishHeatshrink(JsonVariant json, char * topic, bool retained)
 {
-  // orange
-  _ledRGBW(255, 100, 0, 0);
-  _ledOnMillis = millis();
+  // Compress once to size the payload, then again straight into the MQTT client
+  CountPrint count;
+  {
+    HeatshrinkPrint compressor(count);
+    serializeJson(json, compressor);
+    compressor.finish();
+  }
+
+  if (!_mqttClient.beginPublish(topic, count.getCount(), retained)) { return false; }
+
+  _burstClient.begin();
+  HeatshrinkPrint compressor(_mqttClient);
+  serializeJson(json, compressor);
+  compressor.finish();
+  bool flushed = _burstClient.end();
+  _mqttClient.endPublish();
+
+  return compressor.getBytesOut() == count.getCount() && flushed;
+}
+
+bool OXRS_Room8266::_publishMsgPack(JsonVariant json, char * topic)
+{
+  // Stream straight into the MQTT client so payload size isn't limited by its buffer
+  size_t length = measureMsgPack(json);
+  if (!_mqttClient.beginPublish(topic, length, false)) { return false; }
+
+  _burstClient.begin();
+  size_t written = serializeMsgPack(json, _mqttClient);
+  bool flushed = _burstClient.end();
+  _mqttClient.endPublish();
+
+  return written == length && flushed;
 }
 
 /* Adoption info builders */
@@ -121,47 +212,58 @@ void _getFirmwareJson(JsonVariant json)
 #endif
 }
 
-void _getSystemJson(JsonVariant json)
+/* Dirty hack to work out how much program space we are using */
+uint32_t OXRS_Room8266::_getStackSize(void)
+{
+  char stack;
+  return (uint32_t)_stackStart - (uint32_t)&stack;
+}
+
+void OXRS_Room8266::_getSystemJson(JsonVariant json)
 {
   JsonObject system = json["system"].to<JsonObject>();
 
-  system["heapUsedBytes"] = getStackSize();
+  system["heapUsedBytes"] = _getStackSize();
   system["heapFreeBytes"] = ESP.getFreeHeap();
   system["flashChipSizeBytes"] = ESP.getFlashChipSize();
 
-  system["sketchSpaceUsedBytes"] = ESP.getSketchSize();
-  system["sketchSpaceTotalBytes"] = ESP.getFreeSketchSpace();
+  if (!_flashInfoValid)
+  {
+    _flashInfo.sketchSpaceUsedBytes = ESP.getSketchSize();
+    _flashInfo.sketchSpaceTotalBytes = ESP.getFreeSketchSpace();
+
+    FSInfo fs_info;
+    LittleFS.info(fs_info);
+    _flashInfo.fileSystemUsedBytes = fs_info.usedBytes;
+    _flashInfo.fileSystemTotalBytes = fs_info.totalBytes;
+
+    _flashInfoValid = true;
+  }
 
-  FSInfo fs_info;
-  LittleFS.info(fs_info);
-  system["fileSystemUsedBytes"] = fs_info.usedBytes;
-  system["fileSystemTotalBytes"] = fs_info.totalBytes;
+  system["sketchSpaceUsedBytes"] = _flashInfo.sketchSpaceUsedBytes;
+  system["sketchSpaceTotalBytes"] = _flashInfo.sketchSpaceTotalBytes;
+  system["fileSystemUsedBytes"] = _flashInfo.fileSystemUsedBytes;
+  system["fileSystemTotalBytes"] = _flashInfo.fileSystemTotalBytes;
 }
 
-void _getNetworkJson(JsonVariant json)
+void OXRS_Room8266::_getNetworkJson(JsonVariant json)
 {
   JsonObject network = json["network"].to<JsonObject>();
 
   byte mac[6];
+  _transport.getMac(mac);
 
-#if defined(WIFI_MODE)
-  WiFi.macAddress(mac);
-
-  network["mode"] = "wifi";
-  network["ip"] = WiFi.localIP();
-#else
-  Ethernet.MACAddress(mac);
-
-  network["mode"] = "ethernet";
-  network["ip"] = Ethernet.localIP();
-#endif
+  network["mode"] = _transport.getName();
+  network["ip"] = _transport.localIP();
 
   char mac_display[18];
   sprintf_P(mac_display, PSTR("%02X:%02X:%02X:%02X:%02X:%02X"), mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
   network["mac"] = mac_display;
+
+  network["payloadEncoding"] = _msgPackEnabled ? "msgpack" : "json";
 }
 
-void _getConfigSchemaJson(JsonVariant json)
+void OXRS_Room8266::_getConfigSchemaJson(JsonVariant json)
 {
   JsonObject configSchema = json["configSchema"].to<JsonObject>();
   
@@ -175,7 +277,7 @@ void _getConfigSchemaJson(JsonVariant json)
   // Firmware config schema (if any)
   if (!_fwConfigSchema.isNull())
   {
-    _mergeJson(properties, _fwConfigSchema.as<JsonVariant>());
+    mergeJson(properties, _fwConfigSchema.as<JsonVariant>());
   }
 
   // Home Assistant discovery config
@@ -188,9 +290,17 @@ void _getConfigSchemaJson(JsonVariant json)
   hassDiscoveryTopicPrefix["title"] = "Home Assistant Discovery Topic Prefix";
   hassDiscoveryTopicPrefix["description"] = "Prefix for the Home Assistant discovery topic (defaults to 'homeassistant`).";
   hassDiscoveryTopicPrefix["type"] = "string";
+
+  // Status/telemetry payload encoding
+  JsonObject payloadEncoding = properties["payloadEncoding"].to<JsonObject>();
+  payloadEncoding["title"] = "Payload Encoding";
+  payloadEncoding["description"] = "Encoding used for status and telemetry payloads, config and commands are also accepted in this encoding (defaults to 'json').";
+  JsonArray payloadEncodingEnum = payloadEncoding["enum"].to<JsonArray>();
+  payloadEncodingEnum.add("json");
+  payloadEncodingEnum.add("msgpack");
 }
 
-void _getCommandSchemaJson(JsonVariant json)
+void OXRS_Room8266::_getCommandSchemaJson(JsonVariant json)
 {
   JsonObject commandSchema = json["commandSchema"].to<JsonObject>();
   
@@ -204,7 +314,7 @@ void _getCommandSchemaJson(JsonVariant json)
   // Firmware command schema (if any)
   if (!_fwCommandSchema.isNull())
   {
-    _mergeJson(properties, _fwCommandSchema.as<JsonVariant>());
+    mergeJson(properties, _fwCommandSchema.as<JsonVariant>());
   }
 
   // Room8266 commands
@@ -213,8 +323,78 @@ void _getCommandSchemaJson(JsonVariant json)
   restart["type"] = "boolean";
 }
 
+/* Adoption hash */
+uint32_t OXRS_Room8266::_getAdoptHash(void)
+{
+  // Only changes when firmware sets its schemas so cache until then
+  if (!_adoptHashValid)
+  {
+    JsonDocument json(&_adoptHashAllocator);
+    _getFirmwareJson(json.as<JsonVariant>());
+    _getConfigSchemaJson(json.as<JsonVariant>());
+    _getCommandSchemaJson(json.as<JsonVariant>());
+
+    HashPrint hash;
+    serializeJson(json, hash);
+
+    _adoptHash = hash.getHash();
+    _adoptHashValid = true;
+  }
+
+  return _adoptHash;
+}
+
+/* Adoption schema hash persistence */
+uint32_t _readSchemaHash(const char * path)
+{
+  File file = LittleFS.open(path, "r");
+  if (!file) { return 0; }
+
+  char hash[9];
+  size_t length = file.readBytes(hash, sizeof(hash) - 1);
+  hash[length] = 0;
+  file.close();
+
+  return strtoul(hash, NULL, 16);
+}
+
+void OXRS_Room8266::_writeSchemaHash(const char * path, uint32_t hash)
+{
+  File file = LittleFS.open(path, "w");
+  if (!file) { return; }
+
+  file.printf_P(PSTR("%08lx"), (unsigned long)hash);
+  file.close();
+
+  _flashInfoValid = false;
+}
+
+/* Schema compilers */
+void OXRS_Room8266::_compileConfigSchema(void)
+{
+  // Compile the merged (firmware + Room8266) schema
+  JsonDocument json(&_schemaCompileAllocator);
+  _getConfigSchemaJson(json.as<JsonVariant>());
+
+  if (!_configValidator.compile(json["configSchema"]["properties"]))
+  {
+    _logger.println(F("[room] config schema too large, not all keys will be validated"));
+  }
+}
+
+void OXRS_Room8266::_compileCommandSchema(void)
+{
+  JsonDocument json(&_schemaCompileAllocator);
+  _getCommandSchemaJson(json.as<JsonVariant>());
+
+  if (!_commandValidator.compile(json["commandSchema"]["properties"]))
+  {
+    _logger.println(F("[room] command schema too large, not all keys will be validated"));
+  }
+}
+
 /* API callbacks */
-void _apiAdopt(JsonVariant json)
+void OXRS_Room8266::_apiAdopt(JsonVariant json)
 {
   // Build device adoption info
   _getFirmwareJson(json);
@@ -224,24 +404,264 @@ void _apiAdopt(JsonVariant json)
   _getCommandSchemaJson(json);
 }
 
+/* Config handlers */
+void OXRS_Room8266::_configHassDiscoveryEnabled(JsonVariant value)
+{
+  _hassDiscoveryEnabled = value.as<bool>();
+
+  // Check everything again (unchanged entities are skipped)
+  _hassNext = 0;
+}
+
+void OXRS_Room8266::_configHassDiscoveryTopicPrefix(JsonVariant value)
+{
+  // Empty or missing prefix resets to the default
+  const char * prefix = value | "";
+  if (!strlen(prefix)) { prefix = "homeassistant"; }
+
+  if (strcmp(prefix, _hassDiscoveryTopicPrefix) != 0)
+  {
+    strlcpy(_hassDiscoveryTopicPrefix, prefix, sizeof(_hassDiscoveryTopicPrefix));
+
+    // Everything needs publishing under the new prefix
+    for (uint8_t i = 0; i < _hassEntityCount; i++)
+    {
+      _hassEntities[i].hash = 0;
+    }
+    _hassNext = 0;
+  }
+}
+
+void OXRS_Room8266::_configPayloadEncoding(JsonVariant value)
+{
+  _msgPackEnabled = strcmp(value | "json", "msgpack") == 0;
+}
+
+/* Command handlers */
+void _commandRestart(JsonVariant value)
+{
+  if (value.as<bool>())
+  {
+    ESP.restart();
+  }
+}
+
+/* REST helpers */
+void OXRS_Room8266::_restHandle(RestClient & rest)
+{
+  // Adoption content only changes with the firmware schemas, so let
+  // clients skip it entirely if they already have this version
+  if (rest.isRequest("GET", "/adopt"))
+  {
+    // Compress the (potentially large) adoption payload if the client can decode it
+    bool compress = rest.acceptsHeatshrink();
+
+    // Weak, since the hash only covers the firmware and schemas while the body
+    // also carries system/network details (heap, IP etc) which change between
+    // requests. The compressed body still gets its own tag.
+    char tag[16];
+    sprintf_P(tag, compress ? PSTR("\"%08lx-hs\"") : PSTR("\"%08lx\""), (unsigned long)_getAdoptHash());
+
+    char etag[20];
+    sprintf_P(etag, PSTR("W/%s"), tag);
+
+    // Weak comparison, matches with or without the W/ prefix
+    const char * ifNoneMatch = rest.getIfNoneMatch();
+    if (strstr(ifNoneMatch, tag) || strcmp(ifNoneMatch, "*") == 0)
+    {
+      // The API never sees this request, so it is never read
+      rest.skipRequest();
+
+      rest.print(F("HTTP/1.1 304 Not Modified\r\nETag: "));
+      rest.print(etag);
+      rest.print(F("\r\nVary: Accept-Encoding\r\n\r\n"));
+      rest.stop();
+      return;
+    }
+
+    rest.addResponseHeader("ETag", etag);
+    rest.addResponseHeader("Vary", "Accept-Encoding");
+
+    if (compress)
+    {
+      rest.compressResponse();
+    }
+  }
+
+  _api.loop(&rest);
+
+  // Make sure the response is finished even if the API didn't stop the client
+  if (rest.getState() == RestClient::REST_READY)
+  {
+    rest.stop();
+  }
+
+  // Anything other than a GET may have written to flash (config, OTA etc)
+  if (strcmp(rest.getMethod(), "GET") != 0)
+  {
+    _flashInfoValid = false;
+  }
+}
+
+/* Adoption publishers */
+const char * _getAdoptSchemaEncoding(void)
+{
+#if defined(ADOPT_COMPRESSION)
+  return HEATSHRINK_ENCODING;
+#else
+  return "json";
+#endif
+}
+
+void OXRS_Room8266::_publishAdoptSchema(void)
+{
+  char topic[64];
+  _mqtt.getAdoptTopic(topic);
+  strlcat(topic, ADOPT_SCHEMA_TOPIC_SUFFIX, sizeof(topic));
+
+  // Include the topic, and the broker we are connected to, so a client
+  // id/prefix change or moving to another broker also republishes
+  HashPrint hash;
+  hash.print(topic);
+  hash.print(_client.remoteIP());
+  hash.print(_client.remotePort());
+  hash.print(_getAdoptHash());
+  hash.print(_getAdoptSchemaEncoding());
+
+  // Retained on the broker, so nothing to do if it hasn't changed
+#if defined(LOOPBACK_MODE)
+  // Fixed length suffix, client ids can be longer than LittleFS names allow
+  HashPrint clientIdHash;
+  clientIdHash.print(_mqtt.getClientId());
+
+  char hashFile[32];
+  snprintf_P(hashFile, sizeof(hashFile), PSTR("%s.%08lx"), ADOPT_SCHEMA_HASH_FILE, (unsigned long)clientIdHash.getHash());
+#else
+  const char * hashFile = ADOPT_SCHEMA_HASH_FILE;
+#endif
+  if (hash.getHash() == _readSchemaHash(hashFile)) { return; }
+
+  JsonDocument json(&_connectedAllocator);
+  _getFirmwareJson(json.as<JsonVariant>());
+  _getConfigSchemaJson(json.as<JsonVariant>());
+  _getCommandSchemaJson(json.as<JsonVariant>());
+
+  char schemaHash[9];
+  sprintf_P(schemaHash, PSTR("%08lx"), (unsigned long)_getAdoptHash());
+  json["schemaHash"] = schemaHash;
+
+#if defined(ADOPT_COMPRESSION)
+  bool success = _publishHeatshrink(json.as<JsonVariant>(), topic, true);
+#else
+  bool success = _publishJson(json.as<JsonVariant>(), topic, true);
+#endif
+
+  if (success)
+  {
+    _writeSchemaHash(hashFile, hash.getHash());
+  }
+  else
+  {
+    _logger.println(F("[room] failed to publish adoption schema"));
+  }
+}
+
+void OXRS_Room8266::_publishAdoptInfo(void)
+{
+  // Dynamic adoption info, with a pointer to the current schema
+  JsonDocument json(&_connectedAllocator);
+  _getFirmwareJson(json.as<JsonVariant>());
+  _getSystemJson(json.as<JsonVariant>());
+  _getNetworkJson(json.as<JsonVariant>());
+
+  char schemaHash[9];
+  sprintf_P(schemaHash, PSTR("%08lx"), (unsigned long)_getAdoptHash());
+  json["schemaHash"] = schemaHash;
+  json["schemaEncoding"] = _getAdoptSchemaEncoding();
+
+  _mqtt.publishAdopt(json.as<JsonVariant>());
+}
+
+/* Home Assistant discovery */
+bool OXRS_Room8266::_publishHassEntity(HassEntity * entity)
+{
+  char topic[128];
+  snprintf_P(topic, sizeof(topic), PSTR("%s/%s/%s/%s/config"), _hassDiscoveryTopicPrefix, entity->component, _mqtt.getClientId(), entity->id);
+
+  // Common config, the firmware fills in the rest
+  JsonDocument json(&_hassAllocator);
+
+  char uniqueId[64];
+  snprintf_P(uniqueId, sizeof(uniqueId), PSTR("%s_%s"), _mqtt.getClientId(), entity->id);
+  json["uniq_id"] = uniqueId;
+  json["obj_id"] = uniqueId;
+
+  char lwtTopic[64];
+  json["avty_t"] = _mqtt.getLwtTopic(lwtTopic);
+  json["avty_tpl"] = "{% if value_json.online == true %}online{% else %}offline{% endif %}";
+
+  JsonObject device = json["dev"].to<JsonObject>();
+  device["ids"].to<JsonArray>().add(_mqtt.getClientId());
+  device["name"] = FW_SHORT_NAME;
+  device["mf"] = FW_MAKER;
+  device["sw"] = STRINGIFY(FW_VERSION);
+
+  entity->callback(json.as<JsonVariant>(), entity->id);
+
+  // Skip if identical to what we last published
+  HashPrint hash;
+  hash.print(topic);
+  serializeJson(json, hash);
+
+  if (hash.getHash() == entity->hash)
+  {
+    _hassSkipped++;
+    return true;
+  }
+
+  if (!_publishJson(json.as<JsonVariant>(), topic, true))
+  {
+    _hassFailed++;
+    return false;
+  }
+
+  entity->hash = hash.getHash();
+  _hassPublished++;
+  _ledTx();
+  return true;
+}
+
 /* MQTT callbacks */
-void _mqttConnected() 
+void OXRS_Room8266::_mqttConnected() 
 {
+  _mqttAttempted = true;
+  _mqttAttemptSucceeded = true;
+
   // MqttLogger doesn't copy the logging topic to an internal
-  // buffer so we have to use a static array here
-  static char logTopic[64];
-  _logger.setTopic(_mqtt.getLogTopic(logTopic));
+  // buffer so we have to keep it ourselves
+  _logger.setTopic(_mqtt.getLogTopic(_logTopic));
+
+  // Cache the topics we match inbound messages against
+  _mqtt.getConfigTopic(_configTopic);
+  _mqtt.getCommandTopic(_commandTopic);
 
-  // Publish device adoption info
-  JsonDocument json;
-  _mqtt.publishAdopt(_api.getAdopt(json.as<JsonVariant>()));
+  // Publish device adoption info - the (large) schemas only if they have changed
+  _publishAdoptSchema();
+  _publishAdoptInfo();
+
+  // Check all Home Assistant discovery config (published from loop())
+  _hassNext = 0;
 
   // Log the fact we are now connected
   _logger.println("[room] mqtt connected");
 }
 
-void _mqttDisconnected(int state) 
+void OXRS_Room8266::_mqttDisconnected(int state) 
 {
+  // Only raised when a connect attempt fails
+  _mqttAttempted = true;
+  _mqttAttemptSucceeded = false;
+
   // Log the disconnect reason
   // See https://github.com/knolleary/pubsubclient/blob/2d228f2f862a95846c65a8518c79f48dfc8f188c/src/PubSubClient.h#L44
   switch (state)
@@ -276,58 +696,191 @@ void _mqttDisconnected(int state)
   }
 }
 
-void _mqttConfig(JsonVariant json)
+void OXRS_Room8266::_mqttConfig(JsonVariant json)
 {
+  // Reject the whole payload if anything fails schema validation
+  char reason[64];
+  if (!_configValidator.validate(json, reason, sizeof(reason)))
+  {
+    _logger.print(F("[room] invalid config payload: "));
+    _logger.println(reason);
+    return;
+  }
+
+  // Dispatch each key to its registered handler (Room8266 and firmware)
+  _configHandlers.dispatch(json);
+
   // Pass on to the firmware callback
   if (_onConfig) { _onConfig(json); }
 }
 
-void _mqttCommand(JsonVariant json)
+void OXRS_Room8266::_mqttCommand(JsonVariant json)
 {
-  // Check for Room8266 commands
-  if (json.containsKey("restart") && json["restart"].as<bool>())
+  // Reject the whole payload if anything fails schema validation
+  char reason[64];
+  if (!_commandValidator.validate(json, reason, sizeof(reason)))
   {
-    ESP.restart();
+    _logger.print(F("[room] invalid command payload: "));
+    _logger.println(reason);
+    return;
   }
 
+  // Dispatch each key to its registered handler (Room8266 and firmware)
+  _commandHandlers.dispatch(json);
+
   // Pass on to the firmware callback
   if (_onCommand) { _onCommand(json); }
 }
 
-void _mqttCallback(char * topic, byte * payload, int length) 
+uint8_t OXRS_Room8266::_mqttTopicKind(const char * topic)
 {
-  // Update LED
-  _ledRx();
+  if (strcmp(topic, _configTopic) == 0) { return MQTT_TOPIC_CONFIG; }
+  if (strcmp(topic, _commandTopic) == 0) { return MQTT_TOPIC_COMMAND; }
+  return MQTT_TOPIC_UNKNOWN;
+}
 
-  // Pass down to our MQTT handler and check it was processed ok
-  int state = _mqtt.receive(topic, payload, length);
-  switch (state)
+void OXRS_Room8266::_mqttProcess(uint8_t kind, byte * payload, int length)
+{
+  if (length == 0)
   {
-    case MQTT_RECEIVE_ZERO_LENGTH:
-      _logger.println(F("[room] empty mqtt payload received"));
-      break;
-    case MQTT_RECEIVE_JSON_ERROR:
-      _logger.println(F("[room] failed to deserialise mqtt json payload"));
-      break;
-    case MQTT_RECEIVE_NO_CONFIG_HANDLER:
-      _logger.println(F("[room] no mqtt config handler"));
+    _logger.println(F("[room] empty mqtt payload received"));
+    return;
+  }
+
+  // Deserialise straight from the receive/queue buffer into the JSON arena
+  JsonDocument json(&_inboundAllocator);
+
+  // MessagePack is only accepted once negotiated via config
+  DeserializationError error;
+  if (_msgPackEnabled && _isMsgPackMap(payload[0]))
+  {
+    error = deserializeMsgPack(json, payload, length);
+  }
+  else
+  {
+    error = deserializeJson(json, payload, length);
+  }
+
+  if (error)
+  {
+    _logger.print(F("[room] failed to deserialise mqtt payload: "));
+    _logger.println(error.c_str());
+    return;
+  }
+
+  // Route to our config/command handlers
+  switch (kind)
+  {
+    case MQTT_TOPIC_CONFIG:
+      _mqttConfig(json.as<JsonVariant>());
       break;
-    case MQTT_RECEIVE_NO_COMMAND_HANDLER:
-      _logger.println(F("[room] no mqtt command handler"));
+    case MQTT_TOPIC_COMMAND:
+      _mqttCommand(json.as<JsonVariant>());
       break;
   }
 }
 
+void OXRS_Room8266::_mqttCallback(char * topic, byte * payload, int length) 
+{
+  // Update LED
+  _ledRx();
+
+  // Ignore anything we aren't expecting before doing any work
+  uint8_t kind = _mqttTopicKind(topic);
+  if (kind == MQTT_TOPIC_UNKNOWN) { return; }
+
+#if defined(MQTT_INBOUND_QUEUE)
+  // Copy and return straight away, the message is processed from loop()
+  // so firmware handlers never run inside the MQTT client
+  if (!_inboundQueue.push(kind, payload, length))
+  {
+    _logger.println(F("[room] mqtt inbound queue full, message dropped"));
+  }
+#else
+  _mqttProcess(kind, payload, length);
+#endif
+}
+
+/* Callback wrappers */
+void OXRS_Room8266::_onMqttConnected(void)
+{
+  _instance->_mqttConnected();
+}
+
+void OXRS_Room8266::_onMqttDisconnected(int state)
+{
+  _instance->_mqttDisconnected(state);
+}
+
+void OXRS_Room8266::_onMqttMessage(char * topic, byte * payload, unsigned int length)
+{
+  _instance->_mqttCallback(topic, payload, length);
+}
+
+void OXRS_Room8266::_onApiAdopt(JsonVariant json)
+{
+  _instance->_apiAdopt(json);
+}
+
+void OXRS_Room8266::_onConfigHassDiscoveryEnabled(JsonVariant value)
+{
+  _instance->_configHassDiscoveryEnabled(value);
+}
+
+void OXRS_Room8266::_onConfigHassDiscoveryTopicPrefix(JsonVariant value)
+{
+  _instance->_configHassDiscoveryTopicPrefix(value);
+}
+
+void OXRS_Room8266::_onConfigPayloadEncoding(JsonVariant value)
+{
+  _instance->_configPayloadEncoding(value);
+}
+
 /* Main program */
+OXRS_Room8266::OXRS_Room8266(void) :
+  _server(REST_API_PORT),
+  _burstClient(_client),
+  _mqttClient(_burstClient),
+  _mqtt(_mqttClient),
+  _api(_mqtt),
+  _logger(_mqttClient, "log", MqttLoggerMode::MqttAndSerial),
+  _configSchemaAllocator("configSchema"),
+  _commandSchemaAllocator("commandSchema"),
+  _beginAllocator("begin", &_jsonArena),
+  _connectedAllocator("connected", &_jsonArena),
+  _inboundAllocator("inbound", &_jsonArena),
+  _schemaCompileAllocator("schemaCompile", &_jsonArena),
+  _adoptHashAllocator("adoptHash", &_jsonArena),
+  _hassAllocator("hassDiscovery", &_jsonArena),
+  _allocators
+  {
+    &_configSchemaAllocator,
+    &_commandSchemaAllocator,
+    &_beginAllocator,
+    &_connectedAllocator,
+    &_inboundAllocator,
+    &_schemaCompileAllocator,
+    &_adoptHashAllocator,
+    &_hassAllocator,
+  },
+  _fwConfigSchema(&_configSchemaAllocator),
+  _fwCommandSchema(&_commandSchemaAllocator)
+{
+}
+
 void OXRS_Room8266::begin(jsonCallback config, jsonCallback command)
 {
+  // Route library callbacks to this device
+  _instance = this;
+
   // Store the address of the stack at startup so we can determine
-  // the stack size at runtime (see getStackSize())
+  // the stack size at runtime (see _getStackSize())
   char stack;
-  _stack_start = &stack;
+  _stackStart = &stack;
 
   // Get our firmware details
-  JsonDocument json;
+  JsonDocument json(&_beginAllocator);
   _getFirmwareJson(json.as<JsonVariant>());
 
   // Log firmware details
@@ -338,6 +891,10 @@ void OXRS_Room8266::begin(jsonCallback config, jsonCallback command)
   // We wrap the callbacks so we can intercept messages intended for the Rack32
   _onConfig = config;
   _onCommand = command;
+
+  // Compile our schemas (in case firmware hasn't set any)
+  _compileConfigSchema();
+  _compileCommandSchema();
   
   // Set up the RGBW LED
   _initialiseLed();
@@ -355,25 +912,24 @@ void OXRS_Room8266::begin(jsonCallback config, jsonCallback command)
 
 void OXRS_Room8266::loop(void)
 {
-  // Check our network connection
-  if (_isNetworkConnected())
+  // Route library callbacks to this device
+  _instance = this;
+
+  // Check our network connection (raising any link/DHCP/IP events)
+  _loopNetwork();
+
+  if (_networkLinkUp)
   {
-    // Maintain our DHCP lease
-#if not defined(WIFI_MODE)
-    Ethernet.maintain();
-#endif
+    // Only poll our sockets if something may have arrived
+    bool socketEvents = _transport.hasSocketEvents();
     
     // Handle any MQTT messages
-    _mqtt.loop();
+    _loopMqtt(socketEvents);
+    _processInbound();
+    _processHassDiscovery();
     
     // Handle any REST API requests
-#if defined(WIFI_MODE)
-    WiFiClient client = _server.available();
-    _api.loop(&client);
-#else
-    EthernetClient client = _server.available();
-    _api.loop(&client);
-#endif
+    _loopRest(socketEvents);
   }
 
   // Update the LED
@@ -383,13 +939,134 @@ void OXRS_Room8266::loop(void)
 void OXRS_Room8266::setConfigSchema(JsonVariant json)
 {
   _fwConfigSchema.clear();
-  _mergeJson(_fwConfigSchema.as<JsonVariant>(), json);
+  mergeJson(_fwConfigSchema.as<JsonVariant>(), json);
+  _compileConfigSchema();
+  _adoptHashValid = false;
 }
 
 void OXRS_Room8266::setCommandSchema(JsonVariant json)
 {
   _fwCommandSchema.clear();
-  _mergeJson(_fwCommandSchema.as<JsonVariant>(), json);
+  mergeJson(_fwCommandSchema.as<JsonVariant>(), json);
+  _compileCommandSchema();
+  _adoptHashValid = false;
+}
+
+bool OXRS_Room8266::onConfig(const char * key, jsonCallback callback)
+{
+  return _configHandlers.add(key, callback);
+}
+
+bool OXRS_Room8266::onCommand(const char * key, jsonCallback callback)
+{
+  return _commandHandlers.add(key, callback);
+}
+
+bool OXRS_Room8266::getHassDiscoveryEnabled(void)
+{
+  return _hassDiscoveryEnabled;
+}
+
+const char * OXRS_Room8266::getHassDiscoveryTopicPrefix(void)
+{
+  return _hassDiscoveryTopicPrefix;
+}
+
+bool OXRS_Room8266::addHassEntity(const char * component, const char * id, hassCallback callback)
+{
+  if (_hassEntityCount >= HASS_MAX_ENTITIES) { return false; }
+
+  HassEntity * entity = &_hassEntities[_hassEntityCount++];
+  entity->component = component;
+  entity->id = id;
+  entity->callback = callback;
+  entity->hash = 0;
+  return true;
+}
+
+bool OXRS_Room8266::onNetworkEvent(networkEventCallback callback)
+{
+  if (_networkHandlerCount >= MAX_NETWORK_HANDLERS) { return false; }
+
+  _networkHandlers[_networkHandlerCount++] = callback;
+  return true;
+}
+
+void OXRS_Room8266::getMetrics(JsonVariant json)
+{
+  JsonObject metrics = json["metrics"].to<JsonObject>();
+
+  // JSON memory usage
+  JsonObject jsonMetrics = metrics["json"].to<JsonObject>();
+
+  JsonObject arena = jsonMetrics["arena"].to<JsonObject>();
+  arena["sizeBytes"] = JSON_ARENA_SIZE;
+  arena["usedBytes"] = _jsonArena.getUsed();
+  arena["highWaterBytes"] = _jsonArena.getHighWater();
+  arena["overflows"] = _jsonArena.getOverflows();
+
+  JsonObject allocations = jsonMetrics["allocations"].to<JsonObject>();
+  for (TrackingAllocator * allocator : _allocators)
+  {
+    JsonObject site = allocations[allocator->getSite()].to<JsonObject>();
+    site["bytes"] = allocator->getBytes();
+    site["peakBytes"] = allocator->getPeakBytes();
+    site["count"] = allocator->getCount();
+  }
+
+  // REST connection reuse (summed over our connection slots)
+  uint32_t restConnections = 0, restRequests = 0, restReused = 0;
+  for (RestClient & connection : _restConnections)
+  {
+    restConnections += connection.getConnectionCount();
+    restRequests += connection.getRequestCount();
+    restReused += connection.getReusedCount();
+  }
+
+  JsonObject rest = metrics["rest"].to<JsonObject>();
+  rest["connections"] = restConnections;
+  rest["requests"] = restRequests;
+  rest["reusedRequests"] = restReused;
+
+  // MQTT socket operations vs bytes moved (how well reads/writes are coalesced)
+  JsonObject socket = metrics["mqttSocket"].to<JsonObject>();
+  socket["reads"] = _burstClient.getSocketReads();
+  socket["bytesRead"] = _burstClient.getBytesRead();
+  socket["writes"] = _burstClient.getSocketWrites();
+  socket["bytesWritten"] = _burstClient.getBytesWritten();
+
+  // MQTT reconnects
+  JsonObject reconnect = metrics["mqttReconnect"].to<JsonObject>();
+  reconnect["failedAttempts"] = _mqttReconnectAttempts;
+  reconnect["reconnects"] = _mqttReconnects;
+  reconnect["backoffMs"] = _mqttBackoffMs;
+
+  // Home Assistant discovery
+  JsonObject hass = metrics["hassDiscovery"].to<JsonObject>();
+  hass["entities"] = _hassEntityCount;
+  hass["pending"] = _hassEntityCount - _hassNext;
+  hass["published"] = _hassPublished;
+  hass["skipped"] = _hassSkipped;
+  hass["failed"] = _hassFailed;
+
+#if defined(MQTT_INBOUND_QUEUE)
+  // Inbound MQTT queue
+  JsonObject inbound = metrics["mqttInbound"].to<JsonObject>();
+  inbound["queued"] = _inboundQueue.getCount();
+  inbound["dropped"] = _inboundQueue.getDropped();
+#endif
+}
+
+void OXRS_Room8266::setMqttBackoff(uint32_t baseMs, uint32_t maxMs)
+{
+  _mqttBackoffBaseMs = baseMs ? baseMs : 1L;
+  _mqttBackoffMaxMs = maxMs > _mqttBackoffBaseMs ? maxMs : _mqttBackoffBaseMs;
+}
+
+void OXRS_Room8266::setClock(millisCallback millisFunction, delayCallback delayFunction)
+{
+  _clockMillis = millisFunction;
+  _clockDelay = delayFunction;
 }
 
 OXRS_MQTT * OXRS_Room8266::getMQTT()
@@ -402,12 +1079,27 @@ OXRS_API * OXRS_Room8266::getAPI()
   return &_api;
 }
 
+Transport * OXRS_Room8266::getTransport()
+{
+  return &_transport;
+}
+
 bool OXRS_Room8266::publishStatus(JsonVariant json)
 {
   // Exit early if no network connection
   if (!_isNetworkConnected()) { return false; }
 
-  bool success = _mqtt.publishStatus(json);
+  bool success = false;
+  if (_msgPackEnabled)
+  {
+    char topic[64];
+    success = _mqtt.connected() && _publishMsgPack(json, _mqtt.getStatusTopic(topic));
+  }
+  else
+  {
+    success = _mqtt.publishStatus(json);
+  }
+
   if (success) { _ledTx(); }
   return success;
 }
@@ -417,7 +1109,17 @@ bool OXRS_Room8266::publishTelemetry(JsonVariant json)
   // Exit early if no network connection
   if (!_isNetworkConnected()) { return false; }
 
-  bool success = _mqtt.publishTelemetry(json);
+  bool success = false;
+  if (_msgPackEnabled)
+  {
+    char topic[64];
+    success = _mqtt.connected() && _publishMsgPack(json, _mqtt.getTelemetryTopic(topic));
+  }
+  else
+  {
+    success = _mqtt.publishTelemetry(json);
+  }
+
   if (success) { _ledTx(); }
   return success;
 }
@@ -430,58 +1132,33 @@ size_t OXRS_Room8266::write(uint8_t character)
 
 void OXRS_Room8266::_initialiseNetwork(byte * mac)
 {
-  // Get WiFi base MAC address
-  WiFi.macAddress(mac);
-
-#if not defined(WIFI_MODE)
-  // Ethernet MAC address is base MAC + 3
-  // See https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-reference/system/system.html#mac-address
-  mac[5] += 3;
-#endif
+  // Get the MAC address for our network
+  _transport.getMac(mac);
 
   // Format the MAC address for logging
   char mac_display[18];
   sprintf_P(mac_display, PSTR("%02X:%02X:%02X:%02X:%02X:%02X"), mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 
-  // Attempt to connect
-  bool success = false;
-  
-#if defined(WIFI_MODE)
-  _logger.print(F("[room] wifi mac address: "));
+  _logger.print(F("[room] "));
+  _logger.print(_transport.getName());
+  _logger.print(F(" mac address: "));
   _logger.println(mac_display);
 
-  // Ensure we are in the correct WiFi mode
-  WiFi.mode(WIFI_STA);
-
-  // Connect using saved creds, or start captive portal if none found
-  // NOTE: Blocks until connected or the portal is closed
-  WiFiManager wm;
-  success = wm.autoConnect("OXRS_WiFi", "superhouse");
+  // Attempt to connect
+  bool success = _transport.begin(mac);
 
   _logger.print(F("[room] ip address: "));
-  _logger.println(success ? WiFi.localIP() : IPAddress(0, 0, 0, 0));
-#else
-  _logger.print(F("[room] ethernet mac address: "));
-  _logger.println(mac_display);
-
-  // Initialise ethernet library
-  Ethernet.init(ETHERNET_CS_PIN);
+  _logger.println(success ? _transport.localIP() : IPAddress(0, 0, 0, 0));
 
-  // Reset Wiznet W5500
-  pinMode(WIZNET_RESET_PIN, OUTPUT);
-  digitalWrite(WIZNET_RESET_PIN, HIGH);
-  delay(250);
-  digitalWrite(WIZNET_RESET_PIN, LOW);
-  delay(50);
-  digitalWrite(WIZNET_RESET_PIN, HIGH);
-  delay(350);
+  // Our starting state, anything after this is picked up by _loopNetwork()
+  _networkLinkUp = _transport.isConnected();
+  if (_networkLinkUp) { _raiseNetworkEvent(NETWORK_LINK_UP); }
 
-  // Connect ethernet and get an IP address via DHCP
-  success = Ethernet.begin(mac, DHCP_TIMEOUT_MS, DHCP_RESPONSE_TIMEOUT_MS);
-  
-  _logger.print(F("[room] ip address: "));
-  _logger.println(success ? Ethernet.localIP() : IPAddress(0, 0, 0, 0));
-#endif
+  if (success)
+  {
+    _raiseNetworkEvent(NETWORK_DHCP_ACQUIRED);
+    _checkNetworkIP();
+  }
 }
 
 void OXRS_Room8266::_initialiseMqtt(byte * mac)
@@ -495,13 +1172,20 @@ void OXRS_Room8266::_initialiseMqtt(byte * mac)
   _mqtt.setClientId(clientId);
   
   // Register our callbacks
-  _mqtt.onConnected(_mqttConnected);
-  _mqtt.onDisconnected(_mqttDisconnected);
-  _mqtt.onConfig(_mqttConfig);
-  _mqtt.onCommand(_mqttCommand);
+  _mqtt.onConnected(_onMqttConnected);
+  _mqtt.onDisconnected(_onMqttDisconnected);
+
+  // Register handlers for the config/commands we advertise
+  _configHandlers.add(keyHash("hassDiscoveryEnabled"), "hassDiscoveryEnabled", _onConfigHassDiscoveryEnabled);
+  _configHandlers.add(keyHash("hassDiscoveryTopicPrefix"), "hassDiscoveryTopicPrefix", _onConfigHassDiscoveryTopicPrefix);
+  _configHandlers.add(keyHash("payloadEncoding"), "payloadEncoding", _onConfigPayloadEncoding);
+  _commandHandlers.add(keyHash("restart"), "restart", _commandRestart);
   
+  // Seed our reconnect jitter (xorshift needs a non-zero seed)
+  _jitterState = ((uint32_t)mac[2] << 24 | (uint32_t)mac[3] << 16 | (uint32_t)mac[4] << 8 | mac[5]) | 1L;
+
   // Start listening for MQTT messages
-  _mqttClient.setCallback(_mqttCallback);
+  _mqttClient.setCallback(_onMqttMessage);
 }
 
 void OXRS_Room8266::_initialiseRestApi(void)
@@ -514,70 +1198,222 @@ void OXRS_Room8266::_initialiseRestApi(void)
   _api.begin();
   
   // Register our callbacks
-  _api.onAdopt(_apiAdopt);
+  _api.onAdopt(_onApiAdopt);
 
   // Start listening
   _server.begin();
 }
 
+void OXRS_Room8266::_loopNetwork(void)
+{
+  bool linkUp = _transport.isConnected();
+  if (linkUp != _networkLinkUp)
+  {
+    _networkLinkUp = linkUp;
+    _raiseNetworkEvent(linkUp ? NETWORK_LINK_UP : NETWORK_LINK_DOWN);
+
+    if (linkUp)
+    {
+      // Don't sit out a backoff built up while the link was down
+      _mqttBackoffCount = 0;
+      _mqttBackoffMs = 0L;
+
+      // We may have come back on a different network (e.g. WiFi)
+      _checkNetworkIP();
+    }
+    else
+    {
+      // No way of reaching the broker without a link
+      _updateMqttState(false);
+    }
+  }
+
+  if (!linkUp) { return; }
+
+  // Maintain our network (e.g. DHCP lease)
+  switch (_transport.maintain())
+  {
+    case TRANSPORT_RENEW_OK:
+    case TRANSPORT_REBIND_OK:
+      _raiseNetworkEvent(_networkLeaseLost ? NETWORK_DHCP_ACQUIRED : NETWORK_DHCP_RENEWED);
+      _networkLeaseLost = false;
+      _checkNetworkIP();
+      break;
+
+    case TRANSPORT_RENEW_FAILED:
+      // Our lease is still valid, we rebind once it is due
+      _logger.println(F("[room] dhcp renew failed"));
+      break;
+
+    case TRANSPORT_REBIND_FAILED:
+      if (!_networkLeaseLost) { _raiseNetworkEvent(NETWORK_DHCP_LOST); }
+      _networkLeaseLost = true;
+      break;
+  }
+}
+
+void OXRS_Room8266::_loopMqtt(bool socketEvents)
+{
+  // Nothing to read (a disconnect is an event too), so no need to touch the socket
+  if (_mqttWasConnected && !socketEvents && !_mqttReadPending) { return; }
+
+  // Pick up anything which dropped us since last time
+  _updateMqttState(_mqtt.connected());
+
+  // Hold off reconnect attempts until our backoff has expired
+  if (!_mqttWasConnected && (_millis() - _mqttLastAttemptMillis) < _mqttBackoffMs) { return; }
+
+  _mqttAttempted = false;
+  _mqtt.loop();
+
+  // Only count (and back off from) attempts which were actually made
+  if (_mqttAttempted)
+  {
+    _mqttReconnectAttempted(_mqttAttemptSucceeded);
+  }
+  _updateMqttState(_mqtt.connected());
+
+  // PubSubClient handles one packet per loop(), and reading the socket's
+  // events cleared its receive event, so check for more ourselves (our
+  // buffer first, then one read of the socket's received size)
+  _mqttReadPending = _mqttWasConnected && _burstClient.available() > 0;
+}
+
+void OXRS_Room8266::_processInbound(void)
+{
+#if defined(MQTT_INBOUND_QUEUE)
+  // Process a limited number of queued messages each loop
+  uint8_t kind;
+  byte * payload;
+  uint16_t length;
+
+  for (uint8_t i = 0; i < MQTT_INBOUND_BUDGET; i++)
+  {
+    if (!_inboundQueue.peek(&kind, &payload, &length)) { break; }
+
+    _mqttProcess(kind, payload, length);
+    _inboundQueue.pop();
+  }
+#endif
+}
+
+void OXRS_Room8266::_processHassDiscovery(void)
+{
+  if (!_hassDiscoveryEnabled || !_mqttWasConnected) { return; }
+
+  // Nothing to do if every entity is up to date
+  if (_hassNext >= _hassEntityCount) { return; }
+
+  // Pace publishing so we don't block loop() or flood the broker
+  if ((_millis() - _hassLastPublishMillis) < HASS_PUBLISH_INTERVAL_MS) { return; }
+  _hassLastPublishMillis = _millis();
+
+  // Stop at the first failure (e.g. the socket is full) and retry that
+  // entity next time, rather than leaving it unpublished until a reconnect
+  for (uint8_t i = 0; i < HASS_PUBLISH_PER_LOOP && _hassNext < _hassEntityCount; i++)
+  {
+    if (!_publishHassEntity(&_hassEntities[_hassNext])) { break; }
+    _hassNext++;
+  }
+}
+
+void OXRS_Room8266::_loopRest(bool socketEvents)
+{
+  // Accept a new connection if we have a free slot
+  for (uint8_t i = 0; socketEvents && i < REST_MAX_CLIENTS; i++)
+  {
+    if (_restConnections[i].getState() != RestClient::REST_IDLE) { continue; }
+
+    Transport::Client client = _server.accept();
+    if (client)
+    {
+      _restClients[i] = client;
+      _restConnections[i].begin(&_restClients[i]);
+    }
+    break;
+  }
+
+  // Service every connection without blocking, requests are dispatched
+  // to the API as soon as they have been fully received
+  for (uint8_t i = 0; i < REST_MAX_CLIENTS; i++)
+  {
+    // Responses keep draining, but there is nothing new to read without an
+    // event (unless something was left over last time we looked)
+    if (!socketEvents && _restConnections[i].getState() == RestClient::REST_READING && !_restConnections[i].hasPendingInput()) { continue; }
+
+    if (_restConnections[i].poll() == RestClient::REST_READY)
+    {
+      _restHandle(_restConnections[i]);
+    }
+  }
+}
+
 void OXRS_Room8266::_initialiseLed(void)
 {
-  // Start the LED driver
+  // Start the LED driver (set up here rather than on construction
+  // since the pixel buffer is allocated)
+  _led.updateType(NEO_GRBW);
+  _led.updateLength(LED_COUNT);
+  _led.setPin(LED_PIN);
   _led.begin();
 
   // Flash the LED to indicate we are booting
   _ledRGBW(255, 0, 0, 0);
-  delay(500);
+  _delay(500);
   _ledRGBW(0, 255, 0, 0);
-  delay(500);
+  _delay(500);
   _ledRGBW(0, 0, 255, 0);
-  delay(500);
+  _delay(500);
   _ledRGBW(0, 0, 0, 255);
-  delay(500);
+  _delay(500);
   _ledRGBW(0, 0, 0, 0);
 }
 
 void OXRS_Room8266::_updateLed(void)
 {
-  // Don't bother with network checks if we have an activity LED showing
+  // Leave any activity LED showing until it times out
   if (_ledOnMillis)
   {
-    // Turn off LED if timed out
-    if ((millis() - _ledOnMillis) > LED_TIMEOUT_MS)
-    {
-      _ledRGBW(0, 0, 0, 0);
-      _ledOnMillis = 0L;
-    }
+    if ((_millis() - _ledOnMillis) <= LED_TIMEOUT_MS) { return; }
+
+    // Timed out, so show our network status again
+    _ledOnMillis = 0L;
+    _ledStatus = LED_STATUS_NONE;
   }
-  else
+
+  // Network status from our cached state
+  uint8_t status = LED_STATUS_OK;
+  if (!_networkLinkUp)
   {
-    // Check network connection state
-    if (!_isNetworkConnected())
-    {
+    status = LED_STATUS_NO_NETWORK;
+  }
+  else if (!_mqttWasConnected)
+  {
+    status = LED_STATUS_NO_MQTT;
+  }
+
+  // Only drive the LED when the status changes
+  if (status == _ledStatus) { return; }
+  _ledStatus = status;
+
+  switch (status)
+  {
+    case LED_STATUS_NO_NETWORK:
       // RED if no network at all
       _ledRGBW(50, 0, 0, 0);
-    }
-    else
-    {
-      if (!_mqtt.connected())
-      {
-        // BLUE if network, but no MQTT connection
-        _ledRGBW(0, 0, 50, 0);        
-      }
-      else
-      {
-        // GREEN if everything ok
-        _ledRGBW(0, 50, 0, 0);        
-      }
-    }
+      break;
+    case LED_STATUS_NO_MQTT:
+      // BLUE if network, but no MQTT connection
+      _ledRGBW(0, 0, 50, 0);
+      break;
+    case LED_STATUS_OK:
+      // GREEN if everything ok
+      _ledRGBW(0, 50, 0, 0);
+      break;
   }
 }
 
 bool OXRS_Room8266::_isNetworkConnected(void)
 {
-#if defined(WIFI_MODE)
-  return WiFi.status() == WL_CONNECTED;
-#else
-  return Ethernet.linkStatus() == LinkON;
-#endif
+  return _networkLinkUp;
 }
\ No newline at end of file
@@ -7,6 +7,15 @@
 
 #include <OXRS_MQTT.h>                // For MQTT pub/sub
 #include <OXRS_API.h>                 // For REST API
+#include <Adafruit_NeoPixel.h>        // For RGBW LED
+#include <MqttLogger.h>               // For logging
+#include "KeyDispatcher.h"            // For keyed command/config handlers
+#include "SchemaValidator.h"          // For validating config/command payloads
+#include "JsonArena.h"                // For transient JSON documents
+#include "TrackingAllocator.h"        // For JSON allocation accounting
+#include "RestClient.h"               // For REST request/response handling
+#include "BurstClient.h"              // For coalescing MQTT socket reads/writes
+#include "InboundQueue.h"             // For deferring inbound MQTT messages
 
 // Ethernet
 #define       ETHERNET_CS_PIN           15
@@ -14,6 +23,12 @@
 #define       DHCP_TIMEOUT_MS           15000
 #define       DHCP_RESPONSE_TIMEOUT_MS  4000
 
+// Interrupt driven receive (only if WIZNET_INT_PIN is defined), sockets are
+// only polled when INTn flags an event or after this long without one
+#ifndef WIZNET_POLL_INTERVAL_MS
+#define       WIZNET_POLL_INTERVAL_MS   100
+#endif
+
 // I2C
 #define       I2C_SDA                   4
 #define       I2C_SCL                   5
@@ -23,12 +38,124 @@
 #define       LED_COUNT                 1
 #define       LED_TIMEOUT_MS            50
 
+// RGBW LED network status (only redrawn when it changes)
+#define       LED_STATUS_NONE           0
+#define       LED_STATUS_NO_NETWORK     1
+#define       LED_STATUS_NO_MQTT        2
+#define       LED_STATUS_OK             3
+
+// Socket buffer profile. The Ethernet library gives every W5500 socket a
+// fixed 2KB of TX/RX buffer (and addresses it assuming that size, so it
+// can't be re-split per socket). MQTT publishes are coalesced into bursts
+// of up to MQTT_BURST_TX_SIZE (a quarter of the socket buffer by default)
+// and each burst is one socket write. That write blocks, first until the
+// socket buffer has room for the burst (sent data keeps its space until it
+// is acknowledged, so about four default bursts can be awaiting ACKs) and
+// then until the W5500 has sent it. Larger bursts mean fewer SPI round
+// trips and sends for big publishes, at the cost of RAM.
+#ifndef MQTT_BURST_RX_SIZE
+#define       MQTT_BURST_RX_SIZE        128
+#endif
+#ifndef MQTT_BURST_TX_SIZE
+#define       MQTT_BURST_TX_SIZE        512
+#endif
+
 // REST API
 #define       REST_API_PORT             80
+#ifndef REST_MAX_CLIENTS
+#define       REST_MAX_CLIENTS          2
+#endif
+
+// Adoption schema (retained, only republished when its hash changes,
+// heatshrink compressed if ADOPT_COMPRESSION is defined), the last published
+// hash is saved to the hash file (in LOOPBACK_MODE every simulated device
+// shares one file system, so it is suffixed with a hash of the client id)
+#define       ADOPT_SCHEMA_TOPIC_SUFFIX "/schema"
+#define       ADOPT_SCHEMA_HASH_FILE    "/adoptSchema.hash"
+
+// Preallocated arena for inbound and transient JSON documents
+#ifndef JSON_ARENA_SIZE
+#define       JSON_ARENA_SIZE           2048
+#endif
+
+// MQTT reconnect backoff (exponential, with per-device jitter)
+#ifndef MQTT_BACKOFF_BASE_MS
+#define       MQTT_BACKOFF_BASE_MS      1000
+#endif
+#ifndef MQTT_BACKOFF_MAX_MS
+#define       MQTT_BACKOFF_MAX_MS       60000
+#endif
+
+// Inbound MQTT topics
+#define       MQTT_TOPIC_UNKNOWN        0
+#define       MQTT_TOPIC_CONFIG         1
+#define       MQTT_TOPIC_COMMAND        2
+
+// Inbound MQTT queue (only used if MQTT_INBOUND_QUEUE is defined)
+#ifndef MQTT_INBOUND_QUEUE_SIZE
+#define       MQTT_INBOUND_QUEUE_SIZE   2048
+#endif
+#ifndef MQTT_INBOUND_BUDGET
+#define       MQTT_INBOUND_BUDGET       2
+#endif
 
+// Keyed handlers (library + firmware)
+#ifndef MAX_CONFIG_HANDLERS
+#define       MAX_CONFIG_HANDLERS       16
+#endif
+#ifndef MAX_COMMAND_HANDLERS
+#define       MAX_COMMAND_HANDLERS      16
+#endif
+
+// Home Assistant discovery (each entity slot is reserved up front, so raise
+// HASS_MAX_ENTITIES, up to 255, for firmware with more entities)
+#ifndef HASS_TOPIC_PREFIX_SIZE
+#define       HASS_TOPIC_PREFIX_SIZE    64
+#endif
+#ifndef HASS_MAX_ENTITIES
+#define       HASS_MAX_ENTITIES         32
+#endif
+#ifndef HASS_PUBLISH_PER_LOOP
+#define       HASS_PUBLISH_PER_LOOP     2
+#endif
+#ifndef HASS_PUBLISH_INTERVAL_MS
+#define       HASS_PUBLISH_INTERVAL_MS  50
+#endif
+
+// Firmware callback to build the discovery payload for one of its entities
+typedef void (*hassCallback)(JsonVariant json, const char * id);
+
+// Network events (passed to any callbacks registered via onNetworkEvent)
+#define       NETWORK_LINK_UP           1
+#define       NETWORK_LINK_DOWN         2
+#define       NETWORK_DHCP_ACQUIRED     3
+#define       NETWORK_DHCP_RENEWED      4
+#define       NETWORK_DHCP_LOST         5
+#define       NETWORK_IP_CHANGED        6
+#define       NETWORK_MQTT_CONNECTED    7
+#define       NETWORK_MQTT_DISCONNECTED 8
+
+#ifndef MAX_NETWORK_HANDLERS
+#define       MAX_NETWORK_HANDLERS      4
+#endif
+
+// Firmware callback for network events
+typedef void (*networkEventCallback)(uint8_t event);
+
+// Clock the library runs on (see setClock)
+typedef uint32_t (*millisCallback)(void);
+typedef void (*delayCallback)(uint32_t ms);
+
+// Network transport (uses the ethernet defines above)
+#include "Transport.h"
+
+// All state lives in the instance (nothing is allocated on construction), so
+// a host build can run several devices side by side
 class OXRS_Room8266 : public Print
 {
   public:
+    OXRS_Room8266(void);
+
     void begin(jsonCallback config, jsonCallback command);
     void loop(void);
 
@@ -36,12 +163,43 @@ class OXRS_Room8266 : public Print
     void setConfigSchema(JsonVariant json);
     void setCommandSchema(JsonVariant json);
 
+    // Firmware can register a handler for an individual config/command key, each
+    // handler is passed the value for its key (dispatched before the config/command callback)
+    bool onConfig(const char * key, jsonCallback callback);
+    bool onCommand(const char * key, jsonCallback callback);
+
+    // Home Assistant discovery config (set via the hassDiscovery* config keys)
+    bool getHassDiscoveryEnabled(void);
+    const char * getHassDiscoveryTopicPrefix(void);
+
+    // Firmware registers its Home Assistant entities, the library publishes their
+    // (retained) discovery config a few at a time from loop() once MQTT connects
+    bool addHassEntity(const char * component, const char * id, hassCallback callback);
+
+    // Firmware can register for network events (link, DHCP, IP and MQTT changes),
+    // register before begin() to also see the events raised while starting up
+    bool onNetworkEvent(networkEventCallback callback);
+
+    // Library metrics (memory usage, queues etc) for firmware to publish or log
+    void getMetrics(JsonVariant json);
+
+    // MQTT reconnect backoff, doubles from base up to max between failed attempts
+    void setMqttBackoff(uint32_t baseMs, uint32_t maxMs);
+
+    // Replace the clock our own timers and delays run on (e.g. with a host
+    // simulation's virtual clock), NULL for millis()/delay(). Set before begin().
+    void setClock(millisCallback millisFunction, delayCallback delayFunction);
+
     // Return a pointer to the MQTT library
     OXRS_MQTT * getMQTT(void);
 
     // Return a pointer to the API library
     OXRS_API * getAPI(void);
 
+    // Return a pointer to the network transport (e.g. to drive a loopback
+    // transport from a host simulation)
+    Transport * getTransport(void);
+
     // Helpers for publishing to stat/ and tele/ topics
     bool publishStatus(JsonVariant json);
     bool publishTelemetry(JsonVariant json);
@@ -51,10 +209,233 @@ class OXRS_Room8266 : public Print
     using Print::write;
 
   private:
+    // Clock (see setClock)
+    millisCallback _clockMillis = NULL;
+    delayCallback _clockDelay = NULL;
+
+    uint32_t _millis(void);
+    void _delay(uint32_t ms);
+
+    // Network transport (see Transport.h), client (for MQTT)/server (for REST API)
+    Transport _transport;
+    Transport::Client _client;
+    Transport::Server _server;
+    Transport::Client _restClients[REST_MAX_CLIENTS];
+
+    // REST connections being serviced (one per client above)
+    RestClient _restConnections[REST_MAX_CLIENTS];
+
+    // MQTT client (socket reads/writes go in bursts, see BurstClient.h)
+    BurstClient<MQTT_BURST_RX_SIZE, MQTT_BURST_TX_SIZE> _burstClient;
+    PubSubClient _mqttClient;
+    OXRS_MQTT _mqtt;
+
+    // REST API
+    OXRS_API _api;
+
+    // RGBW LED (actually GRBW)
+    Adafruit_NeoPixel _led;
+
+    // Logging (topic updated once MQTT connects successfully, MqttLogger
+    // doesn't copy it so we keep it here)
+    MqttLogger _logger;
+    char _logTopic[64] = "";
+
+    // Preallocated memory for inbound messages and other transient JSON documents
+    JsonArena<JSON_ARENA_SIZE> _jsonArena;
+
+    // JSON allocation accounting, per call site
+    TrackingAllocator _configSchemaAllocator;
+    TrackingAllocator _commandSchemaAllocator;
+    TrackingAllocator _beginAllocator;
+    TrackingAllocator _connectedAllocator;
+    TrackingAllocator _inboundAllocator;
+    TrackingAllocator _schemaCompileAllocator;
+    TrackingAllocator _adoptHashAllocator;
+    TrackingAllocator _hassAllocator;
+
+    TrackingAllocator * _allocators[8];
+
+    // Supported firmware config and command schemas
+    JsonDocument _fwConfigSchema;
+    JsonDocument _fwCommandSchema;
+
+    // MQTT callbacks wrapped by _mqttConfig/_mqttCommand
+    jsonCallback _onConfig = NULL;
+    jsonCallback _onCommand = NULL;
+
+#if defined(MQTT_INBOUND_QUEUE)
+    // Raw inbound MQTT messages waiting to be processed in loop()
+    InboundQueue<MQTT_INBOUND_QUEUE_SIZE> _inboundQueue;
+#endif
+
+    // Compiled config/command schemas for validating inbound payloads
+    SchemaValidator _configValidator;
+    SchemaValidator _commandValidator;
+
+    // Keyed config/command handlers (Room8266 and firmware)
+    KeyDispatcher<MAX_CONFIG_HANDLERS> _configHandlers;
+    KeyDispatcher<MAX_COMMAND_HANDLERS> _commandHandlers;
+
+    // Home Assistant discovery config
+    bool _hassDiscoveryEnabled = false;
+    char _hassDiscoveryTopicPrefix[HASS_TOPIC_PREFIX_SIZE] = "homeassistant";
+
+    // Home Assistant entities registered by the firmware, with the hash of
+    // the discovery config we last published for each
+    struct HassEntity
+    {
+      const char * component;
+      const char * id;
+      hassCallback callback;
+      uint32_t hash;
+    };
+
+    HassEntity _hassEntities[HASS_MAX_ENTITIES];
+    uint8_t _hassEntityCount = 0;
+
+    // Next entity to check/publish (== count when everything is up to date)
+    uint8_t _hassNext = 0;
+    uint32_t _hassLastPublishMillis = 0L;
+
+    uint32_t _hassPublished = 0L;
+    uint32_t _hassSkipped = 0L;
+    uint32_t _hassFailed = 0L;
+
+    // LED timer, and the network status it last showed
+    uint32_t _ledOnMillis = 0L;
+    uint8_t _ledStatus = LED_STATUS_NONE;
+
+    // Network state, cached so each change raises an event (and the rest
+    // of the library doesn't re-read it from the transport every loop)
+    networkEventCallback _networkHandlers[MAX_NETWORK_HANDLERS];
+    uint8_t _networkHandlerCount = 0;
+
+    bool _networkLinkUp = false;
+    bool _networkLeaseLost = false;
+    IPAddress _networkIP;
+
+    // MQTT reconnect backoff, jitter is seeded from our MAC so devices which
+    // lose the broker at the same time don't all retry at the same time
+    uint32_t _mqttBackoffBaseMs = MQTT_BACKOFF_BASE_MS;
+    uint32_t _mqttBackoffMaxMs = MQTT_BACKOFF_MAX_MS;
+    uint32_t _mqttBackoffMs = 0L;
+    uint8_t _mqttBackoffCount = 0;
+    uint32_t _mqttLastAttemptMillis = 0L;
+    bool _mqttWasConnected = false;
+
+    // Input left over after the last loop() (in our buffer or the socket's),
+    // which won't raise another socket event
+    bool _mqttReadPending = false;
+
+    // Set by the connected/disconnected callbacks when a connect is actually
+    // attempted (OXRS_MQTT has its own backoff, so not every loop() tries)
+    bool _mqttAttempted = false;
+    bool _mqttAttemptSucceeded = false;
+    uint32_t _jitterState = 1L;
+
+    uint32_t _mqttReconnectAttempts = 0L;
+    uint32_t _mqttReconnects = 0L;
+
+    // Subscribed topics, cached on connect so inbound messages are matched
+    // without re-building the topic strings each time
+    char _configTopic[64] = "";
+    char _commandTopic[64] = "";
+
+    // Hash of the static adoption content (firmware + schemas)
+    uint32_t _adoptHash = 0;
+    bool _adoptHashValid = false;
+
+    // Flash and file system usage, cached since these are slow to read and only
+    // change when files are written (via the API or by us) or after an OTA update
+    struct FlashInfo
+    {
+      uint32_t sketchSpaceUsedBytes;
+      uint32_t sketchSpaceTotalBytes;
+      size_t fileSystemUsedBytes;
+      size_t fileSystemTotalBytes;
+    };
+
+    FlashInfo _flashInfo;
+    bool _flashInfoValid = false;
+
+    // Address of the stack at startup (for determining used stack size)
+    char * _stackStart = NULL;
+
+    // Status/telemetry payload encoding (JSON unless MessagePack is negotiated via config)
+    bool _msgPackEnabled = false;
+
+    // The MQTT/API libraries only take plain function pointers, so these
+    // pass each callback on to the device currently in begin()/loop()
+    static OXRS_Room8266 * _instance;
+
+    static void _onMqttConnected(void);
+    static void _onMqttDisconnected(int state);
+    static void _onMqttMessage(char * topic, byte * payload, unsigned int length);
+    static void _onApiAdopt(JsonVariant json);
+    static void _onConfigHassDiscoveryEnabled(JsonVariant value);
+    static void _onConfigHassDiscoveryTopicPrefix(JsonVariant value);
+    static void _onConfigPayloadEncoding(JsonVariant value);
+
+    // LED helpers
+    void _ledRGBW(uint8_t r, uint8_t g, uint8_t b, uint8_t w);
+    void _ledRx(void);
+    void _ledTx(void);
+
+    // Backoff helpers
+    uint32_t _jitter(uint32_t range);
+    void _mqttReconnectAttempted(bool success);
+
+    // Publish helpers
+    bool _publishJson(JsonVariant json, char * topic, bool retained);
+    bool _publishHeatshrink(JsonVariant json, char * topic, bool retained);
+    bool _publishMsgPack(JsonVariant json, char * topic);
+
+    // Adoption info
+    uint32_t _getStackSize(void);
+    void _getSystemJson(JsonVariant json);
+    void _getNetworkJson(JsonVariant json);
+    void _getConfigSchemaJson(JsonVariant json);
+    void _getCommandSchemaJson(JsonVariant json);
+    uint32_t _getAdoptHash(void);
+    void _writeSchemaHash(const char * path, uint32_t hash);
+    void _compileConfigSchema(void);
+    void _compileCommandSchema(void);
+    void _apiAdopt(JsonVariant json);
+    void _publishAdoptSchema(void);
+    void _publishAdoptInfo(void);
+
+    // Config handlers
+    void _configHassDiscoveryEnabled(JsonVariant value);
+    void _configHassDiscoveryTopicPrefix(JsonVariant value);
+    void _configPayloadEncoding(JsonVariant value);
+
+    // REST/MQTT handling
+    void _restHandle(RestClient & rest);
+    bool _publishHassEntity(HassEntity * entity);
+    void _mqttConnected(void);
+    void _mqttDisconnected(int state);
+    void _mqttConfig(JsonVariant json);
+    void _mqttCommand(JsonVariant json);
+    uint8_t _mqttTopicKind(const char * topic);
+    void _mqttProcess(uint8_t kind, byte * payload, int length);
+    void _mqttCallback(char * topic, byte * payload, int length);
+
+    // Network events
+    void _raiseNetworkEvent(uint8_t event);
+    void _checkNetworkIP(void);
+    void _updateMqttState(bool connected);
+
     void _initialiseNetwork(byte * mac);
     void _initialiseMqtt(byte * mac);
     void _initialiseRestApi(void);
     
+    void _loopNetwork(void);
+    void _loopMqtt(bool socketEvents);
+    void _processInbound(void);
+    void _processHassDiscovery(void);
+    void _loopRest(bool socketEvents);
+
     void _initialiseLed(void);
     void _updateLed(void);
 
@@ -0,0 +1,641 @@
+/*
+ * RestClient.cpp
+ */
+
+#include "RestClient.h"
+
+char RestClient::_line[REST_LINE_SIZE];
+uint16_t RestClient::_lineLength = 0;
+char RestClient::_extraHeaders[REST_EXTRA_HEADERS_SIZE];
+uint16_t RestClient::_extraHeadersLength = 0;
+HeatshrinkPrint RestClient::_compressor;
+
+RestClient::RestClient(void)
+{
+  _raw.rest = this;
+}
+
+void RestClient::begin(Client * client)
+{
+  _client = client;
+  _requests = 0;
+  _txLength = 0;
+  _headLength = 0;
+  _headPosition = 0;
+  _inputPending = false;
+  _connectionCount++;
+
+  _nextRequest();
+}
+
+RestClient::State RestClient::poll(void)
+{
+  switch (_state)
+  {
+    case REST_READING:
+      if (_readHead())
+      {
+        // Wait for small bodies to arrive so dispatching never blocks on them
+        uint32_t bodyAvailable = (_headLength - _headSize) + _client->available();
+        bool bodyWaiting = _contentLength && _contentLength <= REST_BODY_WAIT_SIZE && bodyAvailable < _contentLength;
+        if (!bodyWaiting)
+        {
+          // Start a fresh response (shared state, see header)
+          _lineLength = 0;
+          _extraHeadersLength = 0;
+          _extraHeaders[0] = 0;
+
+          // Limit how many requests we serve on one connection
+          _requestCount++;
+          if (_requests++ > 0) { _reusedCount++; }
+
+          _keepAlive = _wantsKeepAlive && _requests < REST_MAX_REQUESTS;
+          _holding = _keepAlive;
+          if (!_keepAlive)
+          {
+            addResponseHeader("Connection", "close");
+          }
+
+          _state = REST_READY;
+          break;
+        }
+      }
+
+      // Idle kept-alive connections get longer to send their next request
+      if (!_client->connected() || (millis() - _stateMillis) > ((_requests && !_headLength) ? REST_KEEP_ALIVE_TIMEOUT_MS : REST_HEAD_TIMEOUT_MS))
+      {
+        _close();
+      }
+      break;
+
+    case REST_WRITING:
+      if (_drain(false))
+      {
+        if (_closing) { _close(); } else { _nextRequest(); }
+      }
+      else if (!_client->connected() || (millis() - _stateMillis) > REST_WRITE_TIMEOUT_MS)
+      {
+        _close();
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  // Anything left which won't raise another event (one read of the
+  // socket's received size, only once we are waiting for a request)
+  _inputPending = _state == REST_READING && (_hasBufferedRequest() || _client->available() > 0);
+
+  return _state;
+}
+
+bool RestClient::_hasBufferedRequest(void)
+{
+  if (_state != REST_READING) { return false; }
+
+  for (uint16_t i = 0; i + 4 <= _headLength; i++)
+  {
+    if (memcmp(&_head[i], "\r\n\r\n", 4) == 0) { return true; }
+  }
+  return false;
+}
+
+bool RestClient::isRequest(const char * method, const char * path)
+{
+  return strcmp(_method, method) == 0 && strcmp(_path, path) == 0;
+}
+
+void RestClient::skipRequest(void)
+{
+  // Anything with a body still has to be read, or the connection closed
+  if (_bodyRemaining) { return; }
+  if (_headPosition < _headSize) { _headPosition = _headSize; }
+}
+
+void RestClient::addResponseHeader(const char * name, const char * value)
+{
+  int length = snprintf_P(&_extraHeaders[_extraHeadersLength], REST_EXTRA_HEADERS_SIZE - _extraHeadersLength, PSTR("%s: %s\r\n"), name, value);
+
+  // Drop the header entirely if it doesn't fit
+  if (length > 0 && _extraHeadersLength + length < REST_EXTRA_HEADERS_SIZE)
+  {
+    _extraHeadersLength += length;
+  }
+  else
+  {
+    _extraHeaders[_extraHeadersLength] = 0;
+  }
+}
+
+void RestClient::compressResponse(void)
+{
+  _compress = true;
+  _compressor.begin(_raw);
+  addResponseHeader("Content-Encoding", HEATSHRINK_ENCODING);
+}
+
+size_t RestClient::write(uint8_t character)
+{
+  if (_aborted) { return 0; }
+  return _writeResponse(character);
+}
+
+size_t RestClient::write(const uint8_t * buffer, size_t size)
+{
+  if (_aborted) { return 0; }
+
+  // Once we are into the body there is nothing left to rewrite
+  if (_responseState == RESPONSE_BODY && !_compress)
+  {
+    return _writeRaw(buffer, size);
+  }
+
+  for (size_t i = 0; i < size; i++)
+  {
+    _writeResponse(buffer[i]);
+  }
+  return size;
+}
+
+int RestClient::available(void)
+{
+  return (_headLength - _headPosition) + _client->available();
+}
+
+int RestClient::read(void)
+{
+  // Replay the head we already read before reading from the network
+  if (_headPosition < _headLength)
+  {
+    return _replayHead();
+  }
+
+  int character = _client->read();
+  if (character >= 0 && _bodyRemaining) { _bodyRemaining--; }
+  return character;
+}
+
+int RestClient::read(uint8_t * buffer, size_t size)
+{
+  size_t count = 0;
+  while (count < size && _headPosition < _headLength)
+  {
+    buffer[count++] = _replayHead();
+  }
+
+  if (count < size)
+  {
+    int more = _client->read(&buffer[count], size - count);
+    if (more > 0)
+    {
+      count += more;
+      _bodyRemaining -= min((uint32_t)more, _bodyRemaining);
+    }
+  }
+
+  return count ? count : -1;
+}
+
+int RestClient::peek(void)
+{
+  if (_headPosition < _headLength)
+  {
+    return (uint8_t)_head[_headPosition];
+  }
+  return _client->peek();
+}
+
+void RestClient::flush(void)
+{
+  // Nothing to do, the buffer is drained from poll()
+}
+
+void RestClient::stop(void)
+{
+  // We already gave up on this client
+  if (_aborted)
+  {
+    _lineLength = 0;
+    _close();
+    return;
+  }
+
+  // The API has finished its response, write out anything left over
+  if (_lineLength)
+  {
+    _writeRaw((const uint8_t *)_line, _lineLength);
+    _lineLength = 0;
+  }
+
+  if (_compress && _responseState == RESPONSE_BODY)
+  {
+    _compressor.finish();
+  }
+
+  // The whole response fitted in our buffer so we can frame it and keep the
+  // connection, as long as the API read the whole request (or we lose our place)
+  if (_holding)
+  {
+    if (_responseState == RESPONSE_BODY && _requestRead())
+    {
+      char headers[REST_TX_RESERVE_SIZE];
+      if (_hasBody())
+      {
+        snprintf_P(headers, sizeof(headers), PSTR("Content-Length: %u\r\nConnection: keep-alive\r\n"), (unsigned int)(_txLength - _headerEnd - 2));
+      }
+      else
+      {
+        strcpy_P(headers, PSTR("Connection: keep-alive\r\n"));
+      }
+      _insertRaw(_headerEnd, headers);
+      _holding = false;
+    }
+    else
+    {
+      _release();
+    }
+  }
+
+  // Terminate a chunked response with an empty chunk
+  if (_chunked)
+  {
+    _closeChunk();
+    memcpy(&_tx[_txLength], "0\r\n\r\n", 5);
+    _txLength += 5;
+  }
+
+  // Close (or wait for the next request) once the buffer has drained
+  _closing = !_keepAlive;
+  _state = REST_WRITING;
+  _stateMillis = millis();
+}
+
+uint8_t RestClient::connected(void)
+{
+  return _headPosition < _headLength || _client->connected();
+}
+
+RestClient::operator bool(void)
+{
+  return _headPosition < _headLength || (bool)*_client;
+}
+
+void RestClient::_nextRequest(void)
+{
+  _state = REST_READING;
+  _stateMillis = millis();
+
+  // Keep anything we already read of the next (pipelined) request
+  uint16_t leftover = _headLength - _headPosition;
+  memmove(_head, &_head[_headPosition], leftover);
+  _headLength = leftover;
+  _headPosition = 0;
+  _headScanned = 0;
+  _headSize = 0;
+
+  _method[0] = 0;
+  _path[0] = 0;
+  _ifNoneMatch[0] = 0;
+  _acceptsHeatshrink = false;
+  _contentLength = 0;
+  _http11 = false;
+  _wantsKeepAlive = false;
+  _bodyRemaining = 0;
+
+  _responseState = RESPONSE_STATUS;
+  _status = 0;
+  _compress = false;
+  _closing = false;
+  _aborted = false;
+  _keepAlive = false;
+  _holding = false;
+  _chunked = false;
+  _chunkOpen = false;
+}
+
+bool RestClient::_readHead(void)
+{
+  while (true)
+  {
+    // Look for the blank line which ends the headers in what we have so far
+    for (; _headScanned + 4 <= _headLength; _headScanned++)
+    {
+      if (memcmp(&_head[_headScanned], "\r\n\r\n", 4) == 0)
+      {
+        _headSize = _headScanned + 4;
+        _head[_headLength] = 0;
+        _parseHead();
+        return true;
+      }
+    }
+
+    // Too big for us to parse, pass on what we have and let the API deal with it
+    if (_headLength >= REST_HEAD_SIZE - 1)
+    {
+      _headSize = _headLength;
+      _head[_headLength] = 0;
+      _parseHead();
+
+      // The rest of the head is still to come, we can't tell where it ends
+      _wantsKeepAlive = false;
+      return true;
+    }
+
+    // Read whatever has arrived in one go (a byte at a time is several
+    // SPI transactions per byte on the W5500)
+    int available = _client->available();
+    if (available <= 0) { return false; }
+
+    int count = _client->read((uint8_t *)&_head[_headLength], min(available, REST_HEAD_SIZE - 1 - _headLength));
+    if (count <= 0) { return false; }
+    _headLength += count;
+  }
+}
+
+uint8_t RestClient::_replayHead(void)
+{
+  // Anything past the head itself is body
+  if (_headPosition >= _headSize && _bodyRemaining) { _bodyRemaining--; }
+  return (uint8_t)_head[_headPosition++];
+}
+
+void RestClient::_parseHead(void)
+{
+  // Parsed in place, the head is replayed to the API untouched
+  const char * line = _head;
+  const char * end = _head + _headSize;
+
+  // Request line, e.g. "GET /adopt HTTP/1.1" (query string is ignored)
+  const char * lineEnd = strstr(line, "\r\n");
+  if (!lineEnd) { return; }
+
+  const char * space = (const char *)memchr(line, ' ', lineEnd - line);
+  if (!space) { return; }
+
+  strlcpy(_method, line, min((size_t)(space - line + 1), sizeof(_method)));
+
+  const char * path = space + 1;
+  size_t pathLength = strcspn(path, " ?\r");
+  strlcpy(_path, path, min(pathLength + 1, sizeof(_path)));
+
+  // HTTP/1.1 defaults to keep-alive (a Connection header can override it)
+  const char * version = strstr(path, " HTTP/");
+  _http11 = version && version < lineEnd && strncmp(version, " HTTP/1.1", 9) == 0;
+  _wantsKeepAlive = _http11;
+
+  // Headers
+  for (line = lineEnd + 2; line < end; line = lineEnd + 2)
+  {
+    lineEnd = strstr(line, "\r\n");
+    if (!lineEnd || lineEnd == line) { break; }
+
+    const char * colon = (const char *)memchr(line, ':', lineEnd - line);
+    if (!colon) { continue; }
+
+    const char * value = colon + 1;
+    while (value < lineEnd && *value == ' ') { value++; }
+
+    _parseHeader(line, colon - line, value, lineEnd - value);
+  }
+}
+
+void RestClient::_parseHeader(const char * name, uint16_t nameLength, const char * value, uint16_t valueLength)
+{
+  if (nameLength == 13 && strncasecmp(name, "If-None-Match", nameLength) == 0)
+  {
+    strlcpy(_ifNoneMatch, value, min((size_t)valueLength + 1, sizeof(_ifNoneMatch)));
+  }
+  else if (nameLength == 15 && strncasecmp(name, "Accept-Encoding", nameLength) == 0)
+  {
+    const char * found = strstr(value, "heatshrink");
+    _acceptsHeatshrink = found && found < value + valueLength;
+  }
+  else if (nameLength == 14 && strncasecmp(name, "Content-Length", nameLength) == 0)
+  {
+    _contentLength = strtoul(value, NULL, 10);
+    _bodyRemaining = _contentLength;
+  }
+  else if (nameLength == 10 && strncasecmp(name, "Connection", nameLength) == 0)
+  {
+    if (valueLength >= 10 && strncasecmp(value, "keep-alive", 10) == 0) { _wantsKeepAlive = true; }
+    if (valueLength >= 5 && strncasecmp(value, "close", 5) == 0) { _wantsKeepAlive = false; }
+  }
+}
+
+size_t RestClient::_writeResponse(uint8_t character)
+{
+  if (_responseState == RESPONSE_BODY)
+  {
+    return _compress ? _compressor.write(character) : _writeRaw(&character, 1);
+  }
+
+  // Lines too long to buffer are passed through as-is
+  if (_lineLength >= REST_LINE_SIZE - 1)
+  {
+    _writeRaw((const uint8_t *)_line, _lineLength);
+    _lineLength = 0;
+  }
+
+  _line[_lineLength++] = character;
+
+  if (character == '\n')
+  {
+    _endLine();
+  }
+  return 1;
+}
+
+void RestClient::_endLine(void)
+{
+  bool blank = _lineLength <= 2;
+
+  if (_responseState == RESPONSE_HEADERS && blank)
+  {
+    // Add our headers just before the blank line which ends the headers
+    _writeRaw((const uint8_t *)_extraHeaders, _extraHeadersLength);
+    _headerEnd = _txLength;
+    _responseState = RESPONSE_BODY;
+  }
+  else if (_responseState == RESPONSE_STATUS)
+  {
+    // "HTTP/1.x NNN ..."
+    if (_lineLength > 12) { _status = atoi(&_line[9]); }
+    _responseState = RESPONSE_HEADERS;
+  }
+  else if (strncasecmp(_line, "Connection:", 11) == 0 || ((_compress || _keepAlive) && strncasecmp(_line, "Content-Length:", 15) == 0))
+  {
+    // We decide whether the connection stays open, and work out the
+    // length ourselves if compressing or keeping the connection alive
+    _lineLength = 0;
+    return;
+  }
+
+  _writeRaw((const uint8_t *)_line, _lineLength);
+  _lineLength = 0;
+}
+
+size_t RestClient::_writeRaw(const uint8_t * buffer, size_t size)
+{
+  if (_aborted) { return 0; }
+
+  size_t written = 0;
+  while (written < size)
+  {
+    // Too big to hold for keep-alive, switch to chunks (or closing the connection)
+    if (_holding && _txLength >= REST_TX_BUFFER_SIZE - REST_TX_RESERVE_SIZE)
+    {
+      _release();
+    }
+
+    // Only block on the socket if our buffer is full
+    uint16_t capacity = _txCapacity();
+    if (_txLength >= capacity)
+    {
+      if (_chunked) { _closeChunk(); }
+      if (!_drain(true))
+      {
+        // Not reading (or gone), drop the rest rather than block on every write
+        _aborted = true;
+        _txLength = 0;
+        break;
+      }
+      if (_chunked) { _openChunk(); }
+    }
+
+    size_t chunk = min(size - written, (size_t)(capacity - _txLength));
+    memcpy(&_tx[_txLength], &buffer[written], chunk);
+    _txLength += chunk;
+    written += chunk;
+  }
+  return written;
+}
+
+void RestClient::_insertRaw(uint16_t offset, const char * text)
+{
+  // Only used while holding a response, so there is always reserved room
+  uint16_t length = strlen(text);
+  memmove(&_tx[offset + length], &_tx[offset], _txLength - offset);
+  memcpy(&_tx[offset], text, length);
+  _txLength += length;
+}
+
+void RestClient::_release(void)
+{
+  // Stream the rest and keep the connection, unless the API left some of the
+  // request unread (we would take that as the start of the next request)
+  if (_responseState == RESPONSE_BODY && _http11 && _hasBody() && _requestRead())
+  {
+    // Make what we have so far the first chunk and carry on streaming
+    const char * headers = "Transfer-Encoding: chunked\r\nConnection: keep-alive\r\n";
+    _insertRaw(_headerEnd, headers);
+
+    uint16_t bodyStart = _headerEnd + strlen(headers) + 2;
+    _insertRaw(bodyStart, "0000\r\n");
+    _chunkStart = bodyStart + REST_CHUNK_HEADER_SIZE;
+    _chunkOpen = true;
+    _chunked = true;
+
+    _holding = false;
+    return;
+  }
+
+  if (_responseState == RESPONSE_BODY)
+  {
+    _insertRaw(_headerEnd, "Connection: close\r\n");
+  }
+  else
+  {
+    // Still writing headers, so just add ours at the end
+    addResponseHeader("Connection", "close");
+  }
+
+  _keepAlive = false;
+  _holding = false;
+}
+
+bool RestClient::_requestRead(void)
+{
+  return _headPosition >= _headSize && !_bodyRemaining;
+}
+
+bool RestClient::_hasBody(void)
+{
+  // 1xx, 204 and 304 responses never have a body, so no length or chunks either
+  return !(_status >= 100 && _status < 200) && _status != 204 && _status != 304;
+}
+
+uint16_t RestClient::_txCapacity(void)
+{
+  if (_holding) { return REST_TX_BUFFER_SIZE - REST_TX_RESERVE_SIZE; }
+  if (_chunked) { return REST_TX_BUFFER_SIZE - REST_CHUNK_TRAILER_SIZE; }
+  return REST_TX_BUFFER_SIZE;
+}
+
+void RestClient::_openChunk(void)
+{
+  // Size is filled in when the chunk is closed
+  memcpy(&_tx[_txLength], "0000\r\n", REST_CHUNK_HEADER_SIZE);
+  _txLength += REST_CHUNK_HEADER_SIZE;
+  _chunkStart = _txLength;
+  _chunkOpen = true;
+}
+
+void RestClient::_closeChunk(void)
+{
+  if (!_chunkOpen) { return; }
+  _chunkOpen = false;
+
+  // An empty chunk would end the response, so just drop it
+  uint16_t length = _txLength - _chunkStart;
+  if (!length)
+  {
+    _txLength -= REST_CHUNK_HEADER_SIZE;
+    return;
+  }
+
+  // Fixed width size (leading zeros are allowed) so nothing has to move
+  char header[REST_CHUNK_HEADER_SIZE + 1];
+  snprintf_P(header, sizeof(header), PSTR("%04X\r\n"), length);
+  memcpy(&_tx[_chunkStart - REST_CHUNK_HEADER_SIZE], header, REST_CHUNK_HEADER_SIZE);
+
+  memcpy(&_tx[_txLength], "\r\n", 2);
+  _txLength += 2;
+}
+
+bool RestClient::_drain(bool block)
+{
+  uint32_t progressMillis = millis();
+
+  while (_txLength)
+  {
+    size_t room = _client->availableForWrite();
+    if (room)
+    {
+      size_t sent = _client->write(_tx, min((size_t)_txLength, room));
+      if (sent > 0)
+      {
+        memmove(_tx, &_tx[sent], _txLength - sent);
+        _txLength -= sent;
+
+        // Write timeouts run from the last progress
+        progressMillis = _stateMillis = millis();
+        continue;
+      }
+    }
+
+    if (!block || !_client->connected() || (millis() - progressMillis) > REST_WRITE_TIMEOUT_MS)
+    {
+      return false;
+    }
+    yield();
+  }
+
+  return true;
+}
+
+void RestClient::_close(void)
+{
+  _client->stop();
+  _state = REST_IDLE;
+}
@@ -0,0 +1,218 @@
+/*
+ * RestClient.h
+ */
+
+#ifndef REST_CLIENT_H
+#define REST_CLIENT_H
+
+#include <Arduino.h>
+#include <Client.h>
+#include "HeatshrinkPrint.h"          // For compressed responses
+
+// Request head buffer (request line + headers)
+#ifndef REST_HEAD_SIZE
+#define       REST_HEAD_SIZE            512
+#endif
+#ifndef REST_HEAD_TIMEOUT_MS
+#define       REST_HEAD_TIMEOUT_MS      1000
+#endif
+
+// Request bodies up to this size are waited for before dispatching, so the
+// API never blocks reading them (larger bodies are read as they arrive)
+#ifndef REST_BODY_WAIT_SIZE
+#define       REST_BODY_WAIT_SIZE       1024
+#endif
+
+// Response buffer, drained to the socket across loop() iterations (and the
+// most we send per chunk, well inside the W5500's 2KB socket TX buffer)
+#ifndef REST_TX_BUFFER_SIZE
+#define       REST_TX_BUFFER_SIZE       512
+#endif
+
+// A client which accepts nothing for this long is dropped, along with the
+// rest of its response (measured from the last bytes it accepted, so slow
+// ACKs on a large response are fine but a stalled reader is not)
+#ifndef REST_WRITE_TIMEOUT_MS
+#define       REST_WRITE_TIMEOUT_MS     5000
+#endif
+
+// HTTP/1.1 keep-alive, responses which fit in our buffer get a Content-Length
+// and larger ones are streamed using chunked transfer encoding (we reserve
+// room in the buffer for the framing)
+#ifndef REST_KEEP_ALIVE_TIMEOUT_MS
+#define       REST_KEEP_ALIVE_TIMEOUT_MS  5000
+#endif
+#ifndef REST_MAX_REQUESTS
+#define       REST_MAX_REQUESTS           16
+#endif
+#ifndef REST_TX_RESERVE_SIZE
+#define       REST_TX_RESERVE_SIZE        64
+#endif
+#define       REST_CHUNK_HEADER_SIZE      6
+#define       REST_CHUNK_TRAILER_SIZE     8
+
+// Response header handling
+#ifndef REST_LINE_SIZE
+#define       REST_LINE_SIZE            128
+#endif
+#ifndef REST_EXTRA_HEADERS_SIZE
+#define       REST_EXTRA_HEADERS_SIZE   128
+#endif
+
+// One REST connection. The request head is read incrementally (without
+// blocking) and then replayed to the REST API when the request is ready.
+// The response the API writes is rewritten as needed (extra headers,
+// compression, framing) and buffered, then drained to the socket as it has
+// room, so the connection's own buffering does not grow with the size of
+// the response (the API may still build the whole response in memory first,
+// as the adopt response does). Connections are kept alive between requests
+// as long as the API read the whole request, otherwise they are closed.
+//
+// NOTE: response rewriting state is shared between connections, so a
+//       request must be dispatched as soon as poll() says it is ready
+class RestClient : public Client
+{
+  public:
+    enum State { REST_IDLE, REST_READING, REST_READY, REST_WRITING };
+
+    RestClient(void);
+
+    // Take over a newly accepted connection
+    void begin(Client * client);
+
+    // Read/write whatever we can without blocking, returns the new state
+    State poll(void);
+    State getState(void) { return _state; }
+
+    // True if poll() left input to read which won't raise another socket
+    // event - a pipelined request already in our buffer, or data already
+    // received by the socket when we last looked
+    bool hasPendingInput(void) { return _inputPending; }
+
+    const char * getMethod(void) { return _method; }
+    const char * getPath(void) { return _path; }
+    const char * getIfNoneMatch(void) { return _ifNoneMatch; }
+    bool acceptsHeatshrink(void) { return _acceptsHeatshrink; }
+
+    bool isRequest(const char * method, const char * path);
+
+    // Marks a request without a body as read, for responses written without
+    // passing the request on to the API (so the connection can be kept)
+    void skipRequest(void);
+
+    // Connection reuse counters (across every connection this slot has served)
+    uint32_t getConnectionCount(void) { return _connectionCount; }
+    uint32_t getRequestCount(void) { return _requestCount; }
+    uint32_t getReusedCount(void) { return _reusedCount; }
+
+    // Adds a header to the response written by the API
+    void addResponseHeader(const char * name, const char * value);
+
+    // Heatshrink compresses the response body written by the API
+    void compressResponse(void);
+
+    // Client.h
+    virtual int connect(IPAddress ip, uint16_t port) { return 0; }
+    virtual int connect(const char * host, uint16_t port) { return 0; }
+    virtual size_t write(uint8_t character);
+    virtual size_t write(const uint8_t * buffer, size_t size);
+    virtual int available(void);
+    virtual int read(void);
+    virtual int read(uint8_t * buffer, size_t size);
+    virtual int peek(void);
+    virtual void flush(void);
+    virtual void stop(void);
+    virtual uint8_t connected(void);
+    virtual operator bool(void);
+
+  private:
+    // Raw (post-rewrite) output, so the compressor can write into our buffer
+    class RawOutput : public Print
+    {
+      public:
+        RestClient * rest;
+        virtual size_t write(uint8_t character) { return rest->_writeRaw(&character, 1); }
+        virtual size_t write(const uint8_t * buffer, size_t size) { return rest->_writeRaw(buffer, size); }
+        using Print::write;
+    };
+
+    Client * _client = NULL;
+    State _state = REST_IDLE;
+    uint32_t _stateMillis = 0L;
+
+    // Request
+    // Read from the socket in bulk, so may run past the head into the body
+    // (or the next pipelined request), and _headSize marks where it ends
+    char _head[REST_HEAD_SIZE];
+    uint16_t _headLength = 0;
+    uint16_t _headPosition = 0;
+    uint16_t _headScanned = 0;
+    uint16_t _headSize = 0;
+
+    char _method[8];
+    char _path[32];
+    char _ifNoneMatch[24];
+    bool _acceptsHeatshrink = false;
+    uint32_t _contentLength = 0;
+    bool _http11 = false;
+    bool _wantsKeepAlive = false;
+    uint32_t _bodyRemaining = 0;
+    uint8_t _requests = 0;
+
+    uint32_t _connectionCount = 0;
+    uint32_t _requestCount = 0;
+    uint32_t _reusedCount = 0;
+
+    bool _inputPending = false;
+
+    void _nextRequest(void);
+    bool _hasBufferedRequest(void);
+    bool _readHead(void);
+    uint8_t _replayHead(void);
+    void _parseHead(void);
+    void _parseHeader(const char * name, uint16_t nameLength, const char * value, uint16_t valueLength);
+
+    // Response
+    enum { RESPONSE_STATUS, RESPONSE_HEADERS, RESPONSE_BODY } _responseState = RESPONSE_STATUS;
+    uint16_t _status = 0;
+    bool _compress = false;
+
+    RawOutput _raw;
+    uint8_t _tx[REST_TX_BUFFER_SIZE];
+    uint16_t _txLength = 0;
+    bool _closing = false;
+    bool _aborted = false;
+
+    // Keep-alive responses are held in the buffer until we know their length
+    bool _keepAlive = false;
+    bool _holding = false;
+    uint16_t _headerEnd = 0;
+
+    // Otherwise they are sent in chunks as the buffer fills
+    bool _chunked = false;
+    bool _chunkOpen = false;
+    uint16_t _chunkStart = 0;
+
+    // Only one response is ever being written at a time
+    static char _line[REST_LINE_SIZE];
+    static uint16_t _lineLength;
+    static char _extraHeaders[REST_EXTRA_HEADERS_SIZE];
+    static uint16_t _extraHeadersLength;
+    static HeatshrinkPrint _compressor;
+
+    size_t _writeResponse(uint8_t character);
+    void _endLine(void);
+
+    size_t _writeRaw(const uint8_t * buffer, size_t size);
+    void _insertRaw(uint16_t offset, const char * text);
+    void _release(void);
+    bool _requestRead(void);
+    bool _hasBody(void);
+    uint16_t _txCapacity(void);
+    void _openChunk(void);
+    void _closeChunk(void);
+    bool _drain(bool block);
+    void _close(void);
+};
+
+#endif
@@ -0,0 +1,284 @@
+/*
+ * SchemaValidator.cpp
+ */
+
+#include "Arduino.h"
+#include "SchemaValidator.h"
+#include "KeyDispatcher.h"            // For keyHash
+
+#define       RULE_HAS_MINIMUM          0x01
+#define       RULE_HAS_MAXIMUM          0x02
+
+static uint8_t _parseType(const char * type)
+{
+  if (!type) { return 0; }
+
+  if (strcmp(type, "boolean") == 0) { return SCHEMA_TYPE_BOOLEAN; }
+  if (strcmp(type, "integer") == 0) { return SCHEMA_TYPE_INTEGER; }
+  // an integer is a valid number
+  if (strcmp(type, "number") == 0)  { return SCHEMA_TYPE_NUMBER | SCHEMA_TYPE_INTEGER; }
+  if (strcmp(type, "string") == 0)  { return SCHEMA_TYPE_STRING; }
+  if (strcmp(type, "object") == 0)  { return SCHEMA_TYPE_OBJECT; }
+  if (strcmp(type, "array") == 0)   { return SCHEMA_TYPE_ARRAY; }
+  if (strcmp(type, "null") == 0)    { return SCHEMA_TYPE_NULL; }
+
+  return 0;
+}
+
+static uint8_t _valueType(JsonVariantConst value)
+{
+  if (value.isNull())               { return SCHEMA_TYPE_NULL; }
+  if (value.is<bool>())             { return SCHEMA_TYPE_BOOLEAN; }
+  // any integral value is an integer (1.0, or too big for a long)
+  if (value.is<long>())             { return SCHEMA_TYPE_INTEGER; }
+  if (value.is<double>())           { return value.as<double>() == floor(value.as<double>()) ? SCHEMA_TYPE_INTEGER : SCHEMA_TYPE_NUMBER; }
+  if (value.is<const char *>())     { return SCHEMA_TYPE_STRING; }
+  if (value.is<JsonObjectConst>())  { return SCHEMA_TYPE_OBJECT; }
+  if (value.is<JsonArrayConst>())   { return SCHEMA_TYPE_ARRAY; }
+
+  return 0;
+}
+
+bool SchemaValidator::compile(JsonVariantConst properties)
+{
+  _ruleCount = 0;
+  _enumCount = 0;
+  _stringsUsed = 0;
+
+  bool complete = true;
+  for (JsonPairConst kvp : properties.as<JsonObjectConst>())
+  {
+    if (_ruleCount >= SCHEMA_MAX_RULES)
+    {
+      complete = false;
+      break;
+    }
+
+    JsonVariantConst property = kvp.value();
+
+    // Anything we can't keep the key for is not validated
+    int key = _storeString(kvp.key().c_str());
+    if (key < 0)
+    {
+      complete = false;
+      break;
+    }
+
+    Rule rule;
+    rule.hash = keyHash(kvp.key().c_str());
+    rule.key = key;
+    rule.flags = 0;
+    rule.enumStart = _enumCount;
+    rule.enumCount = 0;
+
+    // Type can be a single type or a list of types
+    if (property["type"].is<JsonArrayConst>())
+    {
+      rule.types = 0;
+      for (JsonVariantConst type : property["type"].as<JsonArrayConst>())
+      {
+        rule.types |= _parseType(type.as<const char *>());
+      }
+    }
+    else
+    {
+      rule.types = _parseType(property["type"].as<const char *>());
+    }
+    if (!rule.types) { rule.types = SCHEMA_TYPE_ANY; }
+
+    if (property["minimum"].is<float>())
+    {
+      rule.minimum = property["minimum"].as<float>();
+      rule.flags |= RULE_HAS_MINIMUM;
+    }
+
+    if (property["maximum"].is<float>())
+    {
+      rule.maximum = property["maximum"].as<float>();
+      rule.flags |= RULE_HAS_MAXIMUM;
+    }
+
+    // Enums are only enforced if every value fits in the shared pools
+    JsonArrayConst values = property["enum"].as<JsonArrayConst>();
+    if (values.size() > 0)
+    {
+      uint16_t stringsUsed = _stringsUsed;
+      bool compiled = _enumCount + values.size() <= SCHEMA_MAX_ENUM_VALUES;
+      for (JsonVariantConst value : values)
+      {
+        if (!compiled) { break; }
+        compiled = _compileEnum(value, &_enumValues[_enumCount + rule.enumCount++]);
+      }
+
+      if (compiled)
+      {
+        _enumCount += rule.enumCount;
+      }
+      else
+      {
+        // Roll back whatever this enum had stored
+        _stringsUsed = stringsUsed;
+        rule.enumCount = 0;
+        complete = false;
+      }
+    }
+
+    // Insert in hash order
+    uint8_t i = _ruleCount++;
+    while (i > 0 && _rules[i - 1].hash > rule.hash)
+    {
+      _rules[i] = _rules[i - 1];
+      i--;
+    }
+    _rules[i] = rule;
+  }
+
+  return complete;
+}
+
+bool SchemaValidator::validate(JsonVariantConst json, char * reason, size_t reasonSize)
+{
+  if (!json.is<JsonObjectConst>())
+  {
+    strlcpy(reason, "payload is not an object", reasonSize);
+    return false;
+  }
+
+  for (JsonPairConst kvp : json.as<JsonObjectConst>())
+  {
+    const char * key = kvp.key().c_str();
+
+    // Keys not in the schema are passed through untouched
+    int index = _find(keyHash(key), key);
+    if (index < 0) { continue; }
+
+    Rule * rule = &_rules[index];
+    JsonVariantConst value = kvp.value();
+
+    // A property without a (known) type accepts anything
+    if (rule->types != SCHEMA_TYPE_ANY && !(_valueType(value) & rule->types))
+    {
+      snprintf_P(reason, reasonSize, PSTR("'%s' has wrong type"), key);
+      return false;
+    }
+
+    if ((rule->flags & RULE_HAS_MINIMUM) && value.is<float>() && value.as<float>() < rule->minimum)
+    {
+      snprintf_P(reason, reasonSize, PSTR("'%s' below minimum"), key);
+      return false;
+    }
+
+    if ((rule->flags & RULE_HAS_MAXIMUM) && value.is<float>() && value.as<float>() > rule->maximum)
+    {
+      snprintf_P(reason, reasonSize, PSTR("'%s' above maximum"), key);
+      return false;
+    }
+
+    if (rule->enumCount)
+    {
+      bool found = false;
+      for (uint8_t i = 0; i < rule->enumCount; i++)
+      {
+        if (_enumMatches(&_enumValues[rule->enumStart + i], value))
+        {
+          found = true;
+          break;
+        }
+      }
+
+      if (!found)
+      {
+        snprintf_P(reason, reasonSize, PSTR("'%s' not a permitted value"), key);
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+int SchemaValidator::_find(uint32_t hash, const char * key)
+{
+  // Lower bound on hash, then check the key to rule out collisions
+  uint8_t lo = 0, hi = _ruleCount;
+  while (lo < hi)
+  {
+    uint8_t mid = (lo + hi) / 2;
+    if (_rules[mid].hash < hash) { lo = mid + 1; } else { hi = mid; }
+  }
+
+  for (; lo < _ruleCount && _rules[lo].hash == hash; lo++)
+  {
+    if (strcmp(&_strings[_rules[lo].key], key) == 0) { return lo; }
+  }
+  return -1;
+}
+
+int SchemaValidator::_storeString(const char * string)
+{
+  size_t length = strlen(string) + 1;
+  if (_stringsUsed + length > sizeof(_strings)) { return -1; }
+
+  uint16_t offset = _stringsUsed;
+  memcpy(&_strings[offset], string, length);
+  _stringsUsed += length;
+  return offset;
+}
+
+bool SchemaValidator::_compileEnum(JsonVariantConst value, EnumValue * entry)
+{
+  // Order matters, a bool is also an integer and an integer also a float
+  if (value.is<bool>())
+  {
+    entry->type = SCHEMA_TYPE_BOOLEAN;
+    entry->integer = value.as<bool>();
+    return true;
+  }
+
+  if (value.is<long>())
+  {
+    entry->type = SCHEMA_TYPE_INTEGER;
+    entry->integer = value.as<long>();
+    return true;
+  }
+
+  if (value.is<float>())
+  {
+    entry->type = SCHEMA_TYPE_NUMBER;
+    entry->number = value.as<float>();
+    return true;
+  }
+
+  if (value.is<const char *>())
+  {
+    int offset = _storeString(value.as<const char *>());
+    if (offset < 0) { return false; }
+
+    entry->type = SCHEMA_TYPE_STRING;
+    entry->string = offset;
+    return true;
+  }
+
+  // null, objects and arrays aren't supported as enum values
+  return false;
+}
+
+bool SchemaValidator::_enumMatches(EnumValue * entry, JsonVariantConst value)
+{
+  switch (entry->type)
+  {
+    case SCHEMA_TYPE_BOOLEAN:
+      return value.is<bool>() && value.as<bool>() == (bool)entry->integer;
+
+    case SCHEMA_TYPE_INTEGER:
+      // 1.0 is the same value as 1
+      return !value.is<bool>() && value.is<double>() && value.as<double>() == (double)entry->integer;
+
+    case SCHEMA_TYPE_NUMBER:
+      return !value.is<bool>() && value.is<float>() && value.as<float>() == entry->number;
+
+    case SCHEMA_TYPE_STRING:
+      return value.is<const char *>() && strcmp(&_strings[entry->string], value.as<const char *>()) == 0;
+  }
+  return false;
+}
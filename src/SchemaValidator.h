@@ -0,0 +1,84 @@
+/*
+ * SchemaValidator.h
+ */
+
+#ifndef SCHEMA_VALIDATOR_H
+#define SCHEMA_VALIDATOR_H
+
+#include <ArduinoJson.h>
+
+// Compiled rule limits (per schema), keys and string enum values are
+// copied into a shared pool so matches never rely on the hash alone
+#ifndef SCHEMA_MAX_RULES
+#define       SCHEMA_MAX_RULES          32
+#endif
+#ifndef SCHEMA_MAX_ENUM_VALUES
+#define       SCHEMA_MAX_ENUM_VALUES    64
+#endif
+#ifndef SCHEMA_STRING_POOL_SIZE
+#define       SCHEMA_STRING_POOL_SIZE   512
+#endif
+
+// JSON schema types
+#define       SCHEMA_TYPE_BOOLEAN       0x01
+#define       SCHEMA_TYPE_INTEGER       0x02
+#define       SCHEMA_TYPE_NUMBER        0x04
+#define       SCHEMA_TYPE_STRING        0x08
+#define       SCHEMA_TYPE_OBJECT        0x10
+#define       SCHEMA_TYPE_ARRAY         0x20
+#define       SCHEMA_TYPE_NULL          0x40
+#define       SCHEMA_TYPE_ANY           0xFF
+
+// Validates the top level keys of a payload against the "properties" of a
+// JSON schema, compiled once into a compact table of types, ranges and enums
+class SchemaValidator
+{
+  public:
+    // Returns false if the schema had more properties/enums than we can hold,
+    // anything that didn't fit is not validated
+    bool compile(JsonVariantConst properties);
+
+    // Returns false and fills in the reason if any known key is invalid
+    bool validate(JsonVariantConst json, char * reason, size_t reasonSize);
+
+  private:
+    struct Rule
+    {
+      uint32_t hash;
+      uint16_t key;
+      float minimum;
+      float maximum;
+      uint8_t types;
+      uint8_t flags;
+      uint8_t enumStart;
+      uint8_t enumCount;
+    };
+
+    Rule _rules[SCHEMA_MAX_RULES];
+    uint8_t _ruleCount = 0;
+
+    // Enum values keep their type, so 1, 1.5, true and "1" are all distinct
+    struct EnumValue
+    {
+      uint8_t type;
+      union
+      {
+        long integer;
+        float number;
+        uint16_t string;
+      };
+    };
+
+    EnumValue _enumValues[SCHEMA_MAX_ENUM_VALUES];
+    uint8_t _enumCount = 0;
+
+    char _strings[SCHEMA_STRING_POOL_SIZE];
+    uint16_t _stringsUsed = 0;
+
+    int _find(uint32_t hash, const char * key);
+    int _storeString(const char * string);
+    bool _compileEnum(JsonVariantConst value, EnumValue * entry);
+    bool _enumMatches(EnumValue * entry, JsonVariantConst value);
+};
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * TrackingAllocator.h
+ */
+
+#ifndef TRACKING_ALLOCATOR_H
+#define TRACKING_ALLOCATOR_H
+
+#include <ArduinoJson.h>
+
+// Wraps another allocator (or the heap) and keeps count of what a single
+// call site allocates - current bytes, peak bytes and number of allocations
+class TrackingAllocator : public ArduinoJson::Allocator
+{
+  public:
+    TrackingAllocator(const char * site, ArduinoJson::Allocator * allocator = NULL)
+      : _site(site), _allocator(allocator) {}
+
+    void * allocate(size_t size) override
+    {
+      byte * block = (byte *)_allocate(HEADER_SIZE + size);
+      if (!block) { return NULL; }
+
+      memcpy(block, &size, sizeof(size_t));
+      _added(size);
+      _count++;
+      return block + HEADER_SIZE;
+    }
+
+    void deallocate(void * pointer) override
+    {
+      if (!pointer) { return; }
+
+      byte * block = (byte *)pointer - HEADER_SIZE;
+      _bytes -= _getSize(block);
+      _deallocate(block);
+    }
+
+    void * reallocate(void * pointer, size_t size) override
+    {
+      if (!pointer) { return allocate(size); }
+
+      byte * block = (byte *)pointer - HEADER_SIZE;
+      size_t oldSize = _getSize(block);
+
+      block = (byte *)_reallocate(block, HEADER_SIZE + size);
+      if (!block) { return NULL; }
+
+      memcpy(block, &size, sizeof(size_t));
+      _bytes -= oldSize;
+      _added(size);
+      return block + HEADER_SIZE;
+    }
+
+    const char * getSite(void) { return _site; }
+    size_t getBytes(void) { return _bytes; }
+    size_t getPeakBytes(void) { return _peakBytes; }
+    uint32_t getCount(void) { return _count; }
+
+  private:
+    // Keeps the 8 byte alignment of the underlying allocator
+    static const size_t HEADER_SIZE = 8;
+
+    const char * _site;
+    ArduinoJson::Allocator * _allocator;
+
+    size_t _bytes = 0;
+    size_t _peakBytes = 0;
+    uint32_t _count = 0;
+
+    void _added(size_t size)
+    {
+      _bytes += size;
+      if (_bytes > _peakBytes) { _peakBytes = _bytes; }
+    }
+
+    size_t _getSize(byte * block)
+    {
+      size_t size;
+      memcpy(&size, block, sizeof(size_t));
+      return size;
+    }
+
+    void * _allocate(size_t size)
+    {
+      return _allocator ? _allocator->allocate(size) : malloc(size);
+    }
+
+    void _deallocate(void * pointer)
+    {
+      if (_allocator) { _allocator->deallocate(pointer); } else { free(pointer); }
+    }
+
+    void * _reallocate(void * pointer, size_t size)
+    {
+      return _allocator ? _allocator->reallocate(pointer, size) : realloc(pointer, size);
+    }
+};
+
+#endif
@@ -0,0 +1,399 @@
+/*
+ * Transport.h
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <Arduino.h>
+
+// Network transports, selected at compile time. Each provides the same
+// interface, so the rest of the library has no network specific code:
+//
+//   Client, Server     client (MQTT, REST connections) and server (REST API) types
+//   getName()          "wifi", "ethernet", ...
+//   getMac(mac)        MAC address used on this network
+//   begin(mac)         bring the network up, true if we got an IP address
+//   maintain()         called from loop() while connected (e.g. DHCP lease),
+//                      returns one of the TRANSPORT_* results below
+//   isConnected()      link status
+//   localIP()
+//   hasSocketEvents()  false if nothing can have arrived on our sockets since
+//                      last asked, so polling them can be skipped
+//
+// Build with WIFI_MODE for WiFi, LOOPBACK_MODE for host simulation, or
+// neither for the W5500 ethernet on the Room8266.
+//
+// NOTE: the ethernet transport uses the pin/timeout defines in OXRS_Room8266.h
+
+// maintain() results (the same values as Ethernet.maintain())
+#define       TRANSPORT_MAINTAIN_NONE   0
+#define       TRANSPORT_RENEW_FAILED    1
+#define       TRANSPORT_RENEW_OK        2
+#define       TRANSPORT_REBIND_FAILED   3
+#define       TRANSPORT_REBIND_OK       4
+
+#if defined(LOOPBACK_MODE)
+
+#include <Client.h>
+#include <IPAddress.h>
+
+// Loopback (host simulation)
+#ifndef LOOPBACK_BUFFER_SIZE
+#define       LOOPBACK_BUFFER_SIZE      2048
+#endif
+#ifndef LOOPBACK_MAX_PENDING
+#define       LOOPBACK_MAX_PENDING      4
+#endif
+
+// One direction of an in-memory connection
+class LoopbackRing
+{
+  public:
+    size_t write(const uint8_t * buffer, size_t size)
+    {
+      size_t written = 0;
+      while (written < size && _length < LOOPBACK_BUFFER_SIZE)
+      {
+        _data[(_head + _length++) % LOOPBACK_BUFFER_SIZE] = buffer[written++];
+      }
+      return written;
+    }
+
+    int read(void)
+    {
+      if (!_length) { return -1; }
+
+      uint8_t character = _data[_head];
+      _head = (_head + 1) % LOOPBACK_BUFFER_SIZE;
+      _length--;
+      return character;
+    }
+
+    int peek(void) { return _length ? _data[_head] : -1; }
+    int available(void) { return _length; }
+    int availableForWrite(void) { return LOOPBACK_BUFFER_SIZE - _length; }
+    void clear(void) { _head = _length = 0; }
+
+  private:
+    uint8_t _data[LOOPBACK_BUFFER_SIZE];
+    uint16_t _head = 0;
+    uint16_t _length = 0;
+};
+
+// An in-memory connection between a device and whatever is simulating the
+// other end (owned by the simulation, a device only ever holds a pointer and
+// the simulation shouldn't reuse it until the device lets go)
+struct LoopbackPipe
+{
+  LoopbackRing toDevice;
+  LoopbackRing fromDevice;
+  bool open = false;
+  bool held = false;
+};
+
+// Called when a device connects out (e.g. to the MQTT broker), returns the
+// pipe to use or NULL to refuse the connection
+typedef LoopbackPipe * (*loopbackConnectCallback)(const char * host, uint16_t port);
+
+class LoopbackClient : public Client
+{
+  public:
+    LoopbackClient(LoopbackPipe * pipe = NULL) : _pipe(pipe) {}
+
+    static loopbackConnectCallback & onConnect(void)
+    {
+      static loopbackConnectCallback callback = NULL;
+      return callback;
+    }
+
+    int connect(IPAddress ip, uint16_t port) { return connect("", port); }
+    int connect(const char * host, uint16_t port)
+    {
+      _pipe = onConnect() ? onConnect()(host, port) : NULL;
+      if (!_pipe) { return 0; }
+
+      _remotePort = port;
+      _pipe->toDevice.clear();
+      _pipe->fromDevice.clear();
+      _pipe->open = true;
+      _pipe->held = true;
+      return 1;
+    }
+
+    size_t write(uint8_t character) { return write(&character, 1); }
+    size_t write(const uint8_t * buffer, size_t size) { return connected() ? _pipe->fromDevice.write(buffer, size) : 0; }
+    int availableForWrite(void) { return connected() ? _pipe->fromDevice.availableForWrite() : 0; }
+
+    int available(void) { return _pipe ? _pipe->toDevice.available() : 0; }
+    int read(void) { return _pipe ? _pipe->toDevice.read() : -1; }
+    int read(uint8_t * buffer, size_t size)
+    {
+      size_t count = 0;
+      while (count < size && available()) { buffer[count++] = read(); }
+      return count ? count : -1;
+    }
+    int peek(void) { return _pipe ? _pipe->toDevice.peek() : -1; }
+    void flush(void) {}
+
+    void stop(void)
+    {
+      if (_pipe)
+      {
+        _pipe->open = false;
+        _pipe->held = false;
+      }
+      _pipe = NULL;
+    }
+
+    // Like the real clients, still connected while there is data to read
+    uint8_t connected(void) { return _pipe && (_pipe->open || _pipe->toDevice.available()); }
+    operator bool(void) { return _pipe != NULL; }
+
+    // Every simulated peer is local
+    IPAddress remoteIP(void) { return IPAddress(127, 0, 0, 1); }
+    uint16_t remotePort(void) { return _remotePort; }
+
+  private:
+    LoopbackPipe * _pipe;
+    uint16_t _remotePort = 0;
+};
+
+class LoopbackServer
+{
+  public:
+    LoopbackServer(uint16_t port) : _port(port) {}
+
+    void begin(void) { _listening = true; }
+
+    // Queue an incoming connection (from the simulation)
+    bool inject(LoopbackPipe * pipe)
+    {
+      if (!_listening || _pendingCount >= LOOPBACK_MAX_PENDING) { return false; }
+
+      pipe->toDevice.clear();
+      pipe->fromDevice.clear();
+      pipe->open = true;
+      pipe->held = true;
+      _pending[_pendingCount++] = pipe;
+      return true;
+    }
+
+    LoopbackClient accept(void)
+    {
+      if (!_pendingCount) { return LoopbackClient(); }
+
+      LoopbackPipe * pipe = _pending[0];
+      memmove(&_pending[0], &_pending[1], --_pendingCount * sizeof(LoopbackPipe *));
+      return LoopbackClient(pipe);
+    }
+
+  private:
+    uint16_t _port;
+    bool _listening = false;
+    LoopbackPipe * _pending[LOOPBACK_MAX_PENDING];
+    uint8_t _pendingCount = 0;
+};
+
+class LoopbackTransport
+{
+  public:
+    typedef LoopbackClient Client;
+    typedef LoopbackServer Server;
+
+    const char * getName(void) { return "loopback"; }
+    void getMac(byte * mac) { memcpy(mac, _mac, sizeof(_mac)); }
+
+    bool begin(byte * mac)
+    {
+      memcpy(_mac, mac, sizeof(_mac));
+      return _linkUp;
+    }
+
+    int maintain(void) { return TRANSPORT_MAINTAIN_NONE; }
+    bool isConnected(void) { return _linkUp; }
+    bool hasSocketEvents(void) { return true; }
+    IPAddress localIP(void) { return _linkUp ? _ip : IPAddress(0, 0, 0, 0); }
+
+    // Driven by the simulation
+    void setMac(const byte * mac) { memcpy(_mac, mac, sizeof(_mac)); }
+    void setLink(bool linkUp) { _linkUp = linkUp; }
+    void setIP(IPAddress ip) { _ip = ip; }
+
+  private:
+    byte _mac[6] = { 0 };
+    bool _linkUp = true;
+    IPAddress _ip = IPAddress(127, 0, 0, 1);
+};
+
+typedef LoopbackTransport Transport;
+
+#elif defined(WIFI_MODE)
+
+#include <ESP8266WiFi.h>              // For networking
+#include <WiFiManager.h>              // For WiFi AP config
+
+class WiFiTransport
+{
+  public:
+    typedef WiFiClient Client;
+    typedef WiFiServer Server;
+
+    const char * getName(void) { return "wifi"; }
+    void getMac(byte * mac) { WiFi.macAddress(mac); }
+
+    bool begin(byte * mac)
+    {
+      // Ensure we are in the correct WiFi mode
+      WiFi.mode(WIFI_STA);
+
+      // Connect using saved creds, or start captive portal if none found
+      // NOTE: Blocks until connected or the portal is closed
+      WiFiManager wm;
+      return wm.autoConnect("OXRS_WiFi", "superhouse");
+    }
+
+    int maintain(void) { return TRANSPORT_MAINTAIN_NONE; }
+    bool isConnected(void) { return WiFi.status() == WL_CONNECTED; }
+    bool hasSocketEvents(void) { return true; }
+    IPAddress localIP(void) { return WiFi.localIP(); }
+};
+
+typedef WiFiTransport Transport;
+
+#else
+
+#include <ESP8266WiFi.h>              // For the base MAC address
+#include <Ethernet.h>                 // For networking
+
+#if defined(WIZNET_INT_PIN)
+#include <utility/w5100.h>            // For W5500 interrupt registers
+
+// W5500 interrupt registers (not wrapped by the Ethernet library)
+#define       W5500_SIR                 0x0017
+#define       W5500_SIMR                0x0018
+#define       W5500_SN_IMR              0x002C
+
+// Socket events which raise INTn (not SEND_OK/TIMEOUT, the Ethernet library
+// waits on those itself so we must never clear them)
+#define       WIZNET_SOCKET_EVENTS      (SnIR::RECV | SnIR::DISCON | SnIR::CON)
+#endif
+
+// Socket budget - MQTT, the REST connections plus one listening, and DHCP
+static_assert(1 + REST_MAX_CLIENTS + 1 + 1 <= MAX_SOCK_NUM, "not enough W5500 sockets for MQTT, REST and DHCP");
+
+class EthernetTransport
+{
+  public:
+    typedef EthernetClient Client;
+    typedef EthernetServer Server;
+
+    const char * getName(void) { return "ethernet"; }
+
+    void getMac(byte * mac)
+    {
+      // Ethernet MAC address is base MAC + 3
+      // See https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-reference/system/system.html#mac-address
+      WiFi.macAddress(mac);
+      mac[5] += 3;
+    }
+
+    bool begin(byte * mac)
+    {
+      // Initialise ethernet library
+      Ethernet.init(ETHERNET_CS_PIN);
+
+      // Reset Wiznet W5500
+      pinMode(WIZNET_RESET_PIN, OUTPUT);
+      digitalWrite(WIZNET_RESET_PIN, HIGH);
+      delay(250);
+      digitalWrite(WIZNET_RESET_PIN, LOW);
+      delay(50);
+      digitalWrite(WIZNET_RESET_PIN, HIGH);
+      delay(350);
+
+      // Connect ethernet and get an IP address via DHCP
+      bool success = Ethernet.begin(mac, DHCP_TIMEOUT_MS, DHCP_RESPONSE_TIMEOUT_MS);
+
+#if defined(WIZNET_INT_PIN)
+      _initialiseInterrupts();
+#endif
+
+      return success;
+    }
+
+    // Maintain our DHCP lease
+    int maintain(void) { return Ethernet.maintain(); }
+    bool isConnected(void) { return Ethernet.linkStatus() == LinkON; }
+    IPAddress localIP(void) { return Ethernet.localIP(); }
+
+    bool hasSocketEvents(void)
+    {
+#if defined(WIZNET_INT_PIN)
+      // Poll anyway every so often (keep alives, or an edge we missed)
+      if (_interruptsEnabled && !_interruptPending && (millis() - _lastEventsMillis) < WIZNET_POLL_INTERVAL_MS) { return false; }
+
+      _interruptPending = false;
+      _lastEventsMillis = millis();
+
+      if (_interruptsEnabled) { _clearInterrupts(); }
+#endif
+      return true;
+    }
+
+#if defined(WIZNET_INT_PIN)
+  private:
+    static inline volatile bool _interruptPending = false;
+    bool _interruptsEnabled = false;
+    uint32_t _lastEventsMillis = 0L;
+
+    static void IRAM_ATTR _onInterrupt(void)
+    {
+      _interruptPending = true;
+    }
+
+    void _initialiseInterrupts(void)
+    {
+      if (Ethernet.hardwareStatus() != EthernetW5500) { return; }
+
+      // INTn is asserted (low) while any unmasked socket event is pending
+      SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+      for (uint8_t s = 0; s < MAX_SOCK_NUM; s++)
+      {
+        W5100.writeSn(s, W5500_SN_IMR, WIZNET_SOCKET_EVENTS);
+        W5100.writeSnIR(s, WIZNET_SOCKET_EVENTS);
+      }
+      W5100.write(W5500_SIMR, (uint8_t)((1 << MAX_SOCK_NUM) - 1));
+      SPI.endTransaction();
+
+      pinMode(WIZNET_INT_PIN, INPUT_PULLUP);
+      attachInterrupt(digitalPinToInterrupt(WIZNET_INT_PIN), _onInterrupt, FALLING);
+
+      _interruptsEnabled = true;
+    }
+
+    void _clearInterrupts(void)
+    {
+      // Clear what is pending so INTn can fall again, a few times over in
+      // case another socket flags something while we are clearing
+      SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+      for (uint8_t i = 0; i < 4; i++)
+      {
+        uint8_t pending = W5100.read(W5500_SIR);
+        if (!pending) { break; }
+
+        for (uint8_t s = 0; s < MAX_SOCK_NUM; s++)
+        {
+          if (pending & (1 << s)) { W5100.writeSnIR(s, WIZNET_SOCKET_EVENTS); }
+        }
+      }
+      SPI.endTransaction();
+    }
+#endif
+};
+
+typedef EthernetTransport Transport;
+
+#endif
+
+#endif